@@ -0,0 +1,491 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "../src/config-kv.h"
+
+#include "../include/BlockStore.h"
+#include "../src/Stats.h"
+
+#include <stdio.h>
+#include <sys/wait.h>
+
+using namespace OOKv;
+
+namespace
+{
+	struct Options
+	{
+		const char* m_path;
+		const char* m_json;
+		size_t      m_block_size;
+		size_t      m_blocks;
+		size_t      m_ops;
+		size_t      m_batch;
+	};
+
+	// Cheap and repeatable, we want the same workload on every run
+	uint64_t next_rand(uint64_t& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	struct Result
+	{
+		const char*         m_name;
+		BlockStore::Latency m_latency;
+		uint64_t            m_elapsed_ns;
+		uint64_t            m_ops;
+		int                 m_err;
+	};
+
+	const size_t s_max_results = 16;
+	Result s_results[s_max_results];
+	size_t s_result_count = 0;
+
+	Result& new_result(const char* name)
+	{
+		Result& r = s_results[s_result_count++];
+		r.m_name = name;
+		memset(&r.m_latency,0,sizeof(r.m_latency));
+		r.m_elapsed_ns = 0;
+		r.m_ops = 0;
+		r.m_err = 0;
+		return r;
+	}
+
+	counter_t mean(const BlockStore::Latency& latency)
+	{
+		return latency.m_count ? latency.m_total_ns / latency.m_count : 0;
+	}
+
+	void remove_store(const char* path)
+	{
+		static const char* const suffixes[] = { "", ".journal", ".lock" };
+		for (size_t i = 0; i < sizeof(suffixes)/sizeof(suffixes[0]); ++i)
+		{
+			char name[1024];
+			snprintf(name,sizeof(name),"%s%s",path,suffixes[i]);
+			unlink(name);
+		}
+	}
+
+	// A private copy of block_id as of trans_id, to change and pass to update_block().
+	// The store keeps the blocks it is given, so each update needs a fresh copy.
+	BlockStore::Block copy_block(BlockStore* store, const Options& opts, const id_t& block_id, const id_t& trans_id, int& err)
+	{
+		BlockStore::Block prev = store->get_block(block_id,trans_id,err);
+		if (err != 0)
+			return BlockStore::Block();
+
+		void* data = OOBase::HeapAllocator::allocate(opts.m_block_size);
+		if (!data)
+		{
+			err = ERROR_OUTOFMEMORY;
+			return BlockStore::Block();
+		}
+
+		memcpy(data,static_cast<const void*>(prev),opts.m_block_size);
+		return BlockStore::Block(data);
+	}
+
+	int populate(BlockStore* store, const Options& opts, id_t& first_block)
+	{
+		int err = 0;
+		id_t trans_id = store->begin_write_transaction(err);
+		if (err != 0)
+			return err;
+
+		first_block = store->alloc_extent(trans_id,opts.m_blocks,err);
+		if (err == 0)
+		{
+			char* data = static_cast<char*>(OOBase::HeapAllocator::allocate(opts.m_block_size));
+			if (!data)
+				err = ERROR_OUTOFMEMORY;
+			else
+			{
+				uint64_t seed = 0x1234567;
+				for (size_t i = 0; err == 0 && i < opts.m_blocks; ++i)
+				{
+					for (size_t j = 0; j < opts.m_block_size; j += sizeof(uint64_t))
+					{
+						uint64_t r = next_rand(seed);
+						memcpy(data + j,&r,sizeof(r));
+					}
+					err = store->write_extent(first_block,trans_id,i * opts.m_block_size,data,opts.m_block_size);
+				}
+				OOBase::HeapAllocator::free(data);
+			}
+		}
+
+		if (err != 0)
+		{
+			store->rollback_write_transaction(trans_id);
+			return err;
+		}
+
+		if ((err = store->commit_write_transaction(trans_id)) == 0)
+			err = store->checkpoint();
+
+		return err;
+	}
+
+	void bench_get(BlockStore* store, const Options& opts, const id_t& first_block, bool random, Result& r)
+	{
+		id_t trans_id = store->begin_read_transaction(r.m_err);
+		if (r.m_err != 0)
+			return;
+
+		uint64_t seed = 0xC0FFEE;
+		uint64_t start = Stats::now_ns();
+		for (size_t i = 0; i < opts.m_ops && r.m_err == 0; ++i)
+		{
+			id_t block_id = first_block + (random ? next_rand(seed) % opts.m_blocks : i % opts.m_blocks);
+
+			uint64_t t = Stats::now_ns();
+			store->get_block(block_id,trans_id,r.m_err);
+			Stats::record(r.m_latency,Stats::now_ns() - t);
+			++r.m_ops;
+		}
+		r.m_elapsed_ns = Stats::now_ns() - start;
+
+		store->end_read_transaction(trans_id);
+	}
+
+	void bench_update(BlockStore* store, const Options& opts, const id_t& first_block, unsigned int density_pct, Result& r)
+	{
+		uint64_t seed = 0xBADF00D + density_pct;
+		uint64_t start = Stats::now_ns();
+		for (size_t i = 0; i < opts.m_ops && r.m_err == 0;)
+		{
+			id_t trans_id = store->begin_write_transaction(r.m_err);
+			if (r.m_err != 0)
+				break;
+
+			for (size_t j = 0; j < opts.m_batch && i < opts.m_ops && r.m_err == 0; ++j, ++i)
+			{
+				id_t block_id = first_block + next_rand(seed) % opts.m_blocks;
+				BlockStore::Block block = copy_block(store,opts,block_id,trans_id-1,r.m_err);
+				if (r.m_err != 0)
+					break;
+
+				char* data = static_cast<char*>(static_cast<void*>(block));
+
+				// Change density_pct of the block in runs of 16 bytes
+				size_t runs = (opts.m_block_size * density_pct / 100) / 16;
+				for (size_t k = 0; k < runs; ++k)
+				{
+					size_t pos = (next_rand(seed) % (opts.m_block_size / 16)) * 16;
+					for (size_t b = 0; b < 16; ++b)
+						data[pos + b] = ~data[pos + b];
+				}
+
+				uint64_t t = Stats::now_ns();
+				r.m_err = store->update_block(block_id,trans_id,block);
+				Stats::record(r.m_latency,Stats::now_ns() - t);
+				++r.m_ops;
+			}
+
+			if (r.m_err == 0)
+				r.m_err = store->commit_write_transaction(trans_id);
+			else
+				store->rollback_write_transaction(trans_id);
+		}
+		r.m_elapsed_ns = Stats::now_ns() - start;
+	}
+
+	void bench_commit(BlockStore* store, const Options& opts, const id_t& first_block, bool sync, Result& r)
+	{
+		store->set_commit_sync(sync);
+
+		uint64_t seed = 0xFEEDFACE;
+		uint64_t start = Stats::now_ns();
+		for (size_t i = 0; i < opts.m_ops && r.m_err == 0; ++i)
+		{
+			id_t trans_id = store->begin_write_transaction(r.m_err);
+			if (r.m_err != 0)
+				break;
+
+			// One small change per transaction, to a random block as it stands
+			id_t block_id = first_block + next_rand(seed) % opts.m_blocks;
+			BlockStore::Block block = copy_block(store,opts,block_id,trans_id-1,r.m_err);
+			if (r.m_err == 0)
+			{
+				static_cast<char*>(static_cast<void*>(block))[i % opts.m_block_size] ^= 0x5A;
+				r.m_err = store->update_block(block_id,trans_id,block);
+			}
+
+			if (r.m_err != 0)
+			{
+				store->rollback_write_transaction(trans_id);
+				break;
+			}
+
+			uint64_t t = Stats::now_ns();
+			r.m_err = store->commit_write_transaction(trans_id);
+			Stats::record(r.m_latency,Stats::now_ns() - t);
+			++r.m_ops;
+		}
+		r.m_elapsed_ns = Stats::now_ns() - start;
+
+		store->set_commit_sync(true);
+	}
+
+	void bench_checkpoint(BlockStore* store, const Options& opts, const id_t& first_block, Result& r)
+	{
+		// Dirty the journal first, then time each checkpoint
+		for (size_t round = 0; round < 8 && r.m_err == 0; ++round)
+		{
+			Result dirty = Result();
+			Options small = opts;
+			small.m_ops = opts.m_batch * 4;
+			bench_update(store,small,first_block,10,dirty);
+			if ((r.m_err = dirty.m_err) != 0)
+				break;
+
+			uint64_t t = Stats::now_ns();
+			r.m_err = store->checkpoint();
+			uint64_t elapsed = Stats::now_ns() - t;
+			Stats::record(r.m_latency,elapsed);
+			r.m_elapsed_ns += elapsed;
+			++r.m_ops;
+		}
+	}
+
+	void bench_recovery(const Options& opts, Result& r)
+	{
+		// Stay under the store's checkpoint interval of 256 commits,
+		// so every transaction after populate() is left in the journal
+		Options dirty_opts = opts;
+		size_t transactions = opts.m_ops / opts.m_batch;
+		if (transactions > 200)
+			transactions = 200;
+		else if (transactions == 0)
+			transactions = 1;
+		dirty_opts.m_ops = transactions * opts.m_batch;
+
+		// Leave a journal behind by exiting without closing the store
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			int err = 0;
+			BlockStore* store = BlockStore::open(opts.m_path,false,err,opts.m_block_size);
+			if (store)
+			{
+				id_t first_block = 0;
+				if ((err = populate(store,opts,first_block)) == 0)
+				{
+					Result dirty = Result();
+					bench_update(store,dirty_opts,first_block,10,dirty);
+					err = dirty.m_err;
+				}
+			}
+			_exit(err ? 1 : 0);
+		}
+
+		int status = 0;
+		if (pid < 0 || waitpid(pid,&status,0) != pid)
+		{
+			r.m_err = errno;
+			return;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			r.m_err = EINTR;
+			return;
+		}
+
+		uint64_t t = Stats::now_ns();
+		BlockStore* store = BlockStore::open(opts.m_path,false,r.m_err,opts.m_block_size);
+		r.m_elapsed_ns = Stats::now_ns() - t;
+		Stats::record(r.m_latency,r.m_elapsed_ns);
+		r.m_ops = transactions;
+
+		if (store)
+		{
+			// Make sure the open really did replay the journal
+			id_t trans_id = store->begin_read_transaction(r.m_err);
+			if (r.m_err == 0)
+			{
+				if (trans_id != 1 + transactions)
+					r.m_err = EINVAL;
+
+				store->end_read_transaction(trans_id);
+			}
+
+			store->release();
+		}
+	}
+
+	void print_text(FILE* f)
+	{
+		fprintf(f,"%-24s %10s %12s %10s %10s %10s %10s %10s\n","workload","ops","ops/sec","mean(ns)","p50(ns)","p99(ns)","max(ns)","error");
+		for (size_t i = 0; i < s_result_count; ++i)
+		{
+			const Result& r = s_results[i];
+			double secs = r.m_elapsed_ns / 1e9;
+			fprintf(f,"%-24s %10llu %12.0f %10llu %10llu %10llu %10llu %10d\n",
+					r.m_name,
+					static_cast<unsigned long long>(r.m_ops),
+					secs > 0 ? r.m_ops / secs : 0.0,
+					static_cast<unsigned long long>(mean(r.m_latency)),
+					static_cast<unsigned long long>(Stats::percentile(r.m_latency,50)),
+					static_cast<unsigned long long>(Stats::percentile(r.m_latency,99)),
+					static_cast<unsigned long long>(r.m_latency.m_max_ns),
+					r.m_err);
+		}
+	}
+
+	void print_json(FILE* f, const Options& opts)
+	{
+		fprintf(f,"{\n  \"block_size\": %lu,\n  \"blocks\": %lu,\n  \"ops\": %lu,\n  \"results\": [\n",
+				static_cast<unsigned long>(opts.m_block_size),
+				static_cast<unsigned long>(opts.m_blocks),
+				static_cast<unsigned long>(opts.m_ops));
+
+		for (size_t i = 0; i < s_result_count; ++i)
+		{
+			const Result& r = s_results[i];
+			fprintf(f,"    { \"name\": \"%s\", \"error\": %d, \"ops\": %llu, \"elapsed_ns\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, \"histogram_log2_ns\": [",
+					r.m_name,
+					r.m_err,
+					static_cast<unsigned long long>(r.m_ops),
+					static_cast<unsigned long long>(r.m_elapsed_ns),
+					static_cast<unsigned long long>(mean(r.m_latency)),
+					static_cast<unsigned long long>(Stats::percentile(r.m_latency,50)),
+					static_cast<unsigned long long>(Stats::percentile(r.m_latency,90)),
+					static_cast<unsigned long long>(Stats::percentile(r.m_latency,99)),
+					static_cast<unsigned long long>(r.m_latency.m_max_ns));
+
+			for (size_t b = 0; b < BlockStore::Latency::s_buckets; ++b)
+				fprintf(f,"%s%llu",b ? "," : "",static_cast<unsigned long long>(r.m_latency.m_buckets[b]));
+
+			fprintf(f,"] }%s\n",i+1 < s_result_count ? "," : "");
+		}
+
+		fprintf(f,"  ]\n}\n");
+	}
+
+	int usage(const char* argv0)
+	{
+		fprintf(stderr,"Usage: %s [--path store] [--json file] [--block-size n] [--blocks n] [--ops n] [--batch n]\n",argv0);
+		return EXIT_FAILURE;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options opts;
+	opts.m_path = "ookv-bench.store";
+	opts.m_json = NULL;
+	opts.m_block_size = BlockStore::s_default_block_size;
+	opts.m_blocks = 4096;
+	opts.m_ops = 20000;
+	opts.m_batch = 16;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i+1 >= argc)
+			return usage(argv[0]);
+
+		if (strcmp(argv[i],"--path") == 0)
+			opts.m_path = argv[++i];
+		else if (strcmp(argv[i],"--json") == 0)
+			opts.m_json = argv[++i];
+		else if (strcmp(argv[i],"--block-size") == 0)
+			opts.m_block_size = strtoul(argv[++i],NULL,10);
+		else if (strcmp(argv[i],"--blocks") == 0)
+			opts.m_blocks = strtoul(argv[++i],NULL,10);
+		else if (strcmp(argv[i],"--ops") == 0)
+			opts.m_ops = strtoul(argv[++i],NULL,10);
+		else if (strcmp(argv[i],"--batch") == 0)
+			opts.m_batch = strtoul(argv[++i],NULL,10);
+		else
+			return usage(argv[0]);
+	}
+
+	if (!opts.m_blocks || !opts.m_ops || !opts.m_batch)
+		return usage(argv[0]);
+
+	remove_store(opts.m_path);
+
+	int err = 0;
+	BlockStore* store = BlockStore::open(opts.m_path,false,err,opts.m_block_size);
+	if (!store)
+	{
+		fprintf(stderr,"Failed to open %s: %s\n",opts.m_path,strerror(err));
+		return EXIT_FAILURE;
+	}
+
+	id_t first_block = 0;
+	if ((err = populate(store,opts,first_block)) != 0)
+	{
+		fprintf(stderr,"Failed to populate %s: %s\n",opts.m_path,strerror(err));
+		store->release();
+		return EXIT_FAILURE;
+	}
+
+	bench_get(store,opts,first_block,false,new_result("get_block_sequential"));
+	bench_get(store,opts,first_block,true,new_result("get_block_random"));
+
+	bench_update(store,opts,first_block,1,new_result("update_block_1pct"));
+	bench_update(store,opts,first_block,10,new_result("update_block_10pct"));
+	bench_update(store,opts,first_block,50,new_result("update_block_50pct"));
+	bench_update(store,opts,first_block,100,new_result("update_block_100pct"));
+
+	Options commits = opts;
+	commits.m_ops = opts.m_ops / 20 + 1;
+	bench_commit(store,commits,first_block,true,new_result("commit_sync"));
+	bench_commit(store,opts,first_block,false,new_result("commit_nosync"));
+
+	bench_checkpoint(store,opts,first_block,new_result("checkpoint"));
+
+	store->release();
+	remove_store(opts.m_path);
+
+	bench_recovery(opts,new_result("recovery_open"));
+	remove_store(opts.m_path);
+
+	print_text(stdout);
+
+	if (opts.m_json)
+	{
+		FILE* f = fopen(opts.m_json,"w");
+		if (!f)
+		{
+			fprintf(stderr,"Failed to open %s: %s\n",opts.m_json,strerror(errno));
+			return EXIT_FAILURE;
+		}
+		print_json(f,opts);
+		fclose(f);
+	}
+
+	for (size_t i = 0; i < s_result_count; ++i)
+	{
+		if (s_results[i].m_err != 0)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
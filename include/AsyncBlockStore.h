@@ -0,0 +1,126 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_ASYNCBLOCKSTORE_H_INCLUDED_
+#define OOKV_ASYNCBLOCKSTORE_H_INCLUDED_
+
+#include "BlockStore.h"
+
+#include <OOBase/Condition.h>
+#include <OOBase/Queue.h>
+#include <OOBase/Vector.h>
+#include <OOBase/Thread.h>
+
+namespace OOKv
+{
+	// Runs the blocking BlockStore calls on worker threads and reports the
+	// results through callbacks, so an event loop thread never waits on a
+	// lock, a cache miss or an fsync.  Reads are spread over a pool of threads,
+	// writes go through a single thread in the order they were posted.
+	// A begin or checkpoint posted while another write transaction is open is set
+	// aside, without holding up the writer thread, until that transaction commits
+	// or rolls back.
+	//
+	// update_block() reads the previous version of the block, so it is posted too.
+	// alloc_block(), alloc_extent(), write_extent() and free_block() only add to
+	// the in-memory log, and can be called on the BlockStore directly.
+	//
+	// Callbacks run on the worker threads: post the result back to the event
+	// loop from there, and keep the callback short.
+	class AsyncBlockStore
+	{
+	public:
+		typedef void (*BlockCallback)(void* param, const id_t& block_id, BlockStore::Block block, int err);
+		typedef void (*TransCallback)(void* param, const id_t& trans_id, int err);
+
+		AsyncBlockStore();
+		~AsyncBlockStore();
+
+		int open(BlockStore* store, size_t read_threads = 2);
+
+		// Waits for every posted request to complete
+		void close();
+
+		// The post functions only fail if the request could not be queued,
+		// otherwise the outcome is passed to the callback
+		int get_block(const id_t& block_id, const id_t& trans_id, BlockCallback callback, void* param);
+
+		int begin_write_transaction(TransCallback callback, void* param);
+		int update_block(const id_t& block_id, const id_t& trans_id, BlockStore::Block block, BlockCallback callback, void* param);
+		int commit_write_transaction(const id_t& trans_id, TransCallback callback, void* param);
+		int rollback_write_transaction(const id_t& trans_id, TransCallback callback, void* param);
+		int checkpoint(TransCallback callback, void* param);
+
+	private:
+		AsyncBlockStore(const AsyncBlockStore&);
+		AsyncBlockStore& operator = (const AsyncBlockStore&);
+
+		enum Op
+		{
+			GetBlock = 0,
+			BeginWrite,
+			UpdateBlock,
+			CommitWrite,
+			RollbackWrite,
+			Checkpoint
+		};
+
+		struct Request
+		{
+			Op                m_op;
+			id_t              m_block_id;
+			id_t              m_trans_id;
+			BlockStore::Block m_block;
+			BlockCallback     m_block_callback;
+			TransCallback     m_trans_callback;
+			void*             m_param;
+		};
+
+		struct Worker
+		{
+			AsyncBlockStore*                m_owner;
+			OOBase::Condition::Mutex        m_lock;
+			OOBase::Condition               m_condition;
+			OOBase::Queue<Request>          m_queue;
+			OOBase::Vector<OOBase::Thread*> m_threads;
+			bool                            m_closing;
+
+			// Begins and checkpoints waiting for the open transaction to finish,
+			// oldest first.
+			// Only the writer thread uses them.
+			OOBase::Vector<Request>         m_deferred;
+			bool                            m_retry;
+		};
+
+		BlockStore* m_store;
+		Worker      m_readers;
+		Worker      m_writer;
+
+		int start(Worker& worker, size_t threads);
+		void stop(Worker& worker);
+		int post(Worker& worker, const Request& req);
+		bool execute(const Request& req, bool closing);
+
+		static int run(void* param);
+	};
+}
+
+#endif // OOKV_ASYNCBLOCKSTORE_H_INCLUDED_
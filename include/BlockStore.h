@@ -33,9 +33,11 @@ namespace OOKv
 
 #if defined(_MSC_VER)
 	typedef unsigned __int64 id_t;
+	typedef unsigned __int64 counter_t;
 #elif defined(HAVE_STDINT_H)
 #include <stdint.h>
 	typedef ::uint64_t id_t;
+	typedef ::uint64_t counter_t;
 #else
 #error Failed to work out a base type for unsigned 64bit integer.
 #endif
@@ -43,9 +45,75 @@ namespace OOKv
 	class BlockStore : public OOBase::RefCounted
 	{
 	public:
-		static const size_t s_block_size = 4096;
+		// Supported block sizes are the powers of 2 from 4KiB to 64KiB
+		static const size_t s_default_block_size = 4096;
 
-		static BlockStore* open(const char* path, bool read_only, int& err);
+		// block_size is only used when creating a new store, existing stores keep their own
+		static BlockStore* open(const char* path, bool read_only, int& err, size_t block_size = s_default_block_size);
+
+		// Open a follower of another store.  path is a local copy, typically seeded from
+		// a full backup(), that replicate() keeps up to date with the journal records
+		// read from source, which may be the primary's journal file or a pipe
+		static BlockStore* open_replica(const char* path, const char* source, int& err, size_t block_size = s_default_block_size);
+
+		// For replicas, apply every complete transaction available from the source
+		// without waiting for more, and return the last transaction now visible.
+		// timeout bounds the wait for a checkpoint of the replica to finish.
+		virtual int replicate(id_t& last_trans_id, const OOBase::Timeout& timeout = OOBase::Timeout()) = 0;
+
+		virtual size_t block_size() const = 0;
+
+		// Latencies are counted in power of 2 nanosecond buckets
+		struct Latency
+		{
+			static const size_t s_buckets = 40;
+
+			counter_t m_count;
+			counter_t m_total_ns;
+			counter_t m_max_ns;
+			counter_t m_buckets[s_buckets];
+		};
+
+		struct Statistics
+		{
+			counter_t m_get_block_hits;
+			counter_t m_get_block_misses;
+			counter_t m_shared_cache_hits;
+			counter_t m_remote_cache_hits;
+			counter_t m_journal_transactions_replayed;
+			counter_t m_journal_records_replayed;
+			counter_t m_commits;
+			counter_t m_commit_bytes;
+			counter_t m_checkpoints;
+			counter_t m_checkpoint_bytes;
+
+			Latency   m_commit_write;
+			Latency   m_commit_sync;
+			Latency   m_commit_checkpoint;
+			Latency   m_checkpoint;
+			Latency   m_write_lock_wait;
+		};
+
+		// A snapshot of the counters since the store was opened
+		virtual void get_stats(Statistics& stats) const = 0;
+
+		// Write a consistent image of the store to path, as of a new read transaction
+		// whose id is returned in trans_id.  If since_trans_id is 0 the image is a
+		// complete store that can be opened directly, otherwise it holds only the
+		// blocks changed after since_trans_id, which must still be in the journal.
+		virtual int backup(const char* path, const id_t& since_trans_id, id_t& trans_id) = 0;
+
+#if !defined(_WIN32)
+		// As above, but written strictly in order to fd, which may be a pipe or a socket.
+		// fd is left open, and is not synced.
+		virtual int backup(int fd, const id_t& since_trans_id, id_t& trans_id) = 0;
+#endif
+
+		// Apply an incremental backup() to this store, which must be exactly at the
+		// backup's since_trans_id, e.g. a full backup taken then, with no open read
+		// transactions.  The blocks are written straight over the store, so if this
+		// fails part way the same backup must be applied again before the store is used.
+		virtual int restore(const char* path) = 0;
 
 		virtual id_t begin_read_transaction(int& err) = 0;
 		virtual int end_read_transaction(const id_t& trans_id) = 0;
@@ -56,14 +124,39 @@ namespace OOKv
 
 		virtual int checkpoint(const OOBase::Timeout& timeout = OOBase::Timeout()) = 0;
 
+		// Not syncing the journal on commit risks losing the latest transactions
+		// after a crash, but the store will still be consistent
+		virtual void set_commit_sync(bool sync) = 0;
+
 		typedef OOBase::SmartPtr<void*> Block;
 
+		// Blocks are shared with the cache, never change the data of a returned block
 		virtual Block get_block(const id_t& block_id, const id_t& trans_id, int& err) = 0;
 
+		// The store keeps block: it becomes the cached version, and the journal is
+		// written from its data at commit.  Do not change it afterwards, copy it instead.
 		virtual int update_block(const id_t& block_id, const id_t& trans_id, Block block) = 0;
+
+		// Returns the new block's id, and a zeroed block of its own in block to fill in
 		virtual id_t alloc_block(const id_t& trans_id, Block& block, int& err) = 0;
 		virtual int free_block(const id_t& block_id, const id_t& trans_id) = 0;
 
+		// Large values live in contiguous extents of blocks.
+		// Writes must start on a block boundary, a short final block is zero padded,
+		// and only extents allocated by the same write transaction can be written.
+		virtual id_t alloc_extent(const id_t& trans_id, size_t block_count, int& err) = 0;
+		virtual int write_extent(const id_t& block_id, const id_t& trans_id, size_t offset, const void* data, size_t length) = 0;
+		virtual int read_extent(const id_t& block_id, const id_t& trans_id, size_t offset, void* data, size_t length) = 0;
+
+		// Called by compact() for each block it moves, to update the references to it
+		// in the same transaction
+		typedef int (*RelocateCallback)(void* param, const id_t& trans_id, const id_t& from_block_id, const id_t& to_block_id);
+
+		// Move live blocks from the end of the store into free slots, in the write
+		// transaction trans_id, so the store can shrink.  The store file is truncated
+		// at a later checkpoint, once no read transaction can see the moved blocks.
+		virtual int compact(const id_t& trans_id, RelocateCallback callback, void* param) = 0;
+
 	protected:
 		BlockStore() : OOBase::RefCounted() {};
 	};
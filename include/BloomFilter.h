@@ -0,0 +1,97 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_BLOOMFILTER_H_INCLUDED_
+#define OOKV_BLOOMFILTER_H_INCLUDED_
+
+#include "BlockStore.h"
+
+#include <OOBase/Mutex.h>
+
+namespace OOKv
+{
+	// A blocked Bloom filter kept in an extent of BlockStore pages.
+	// Each key sets its bits within a single 64 byte line, so a probe touches one
+	// cache line of the in-memory copy and never the block cache.  Bits are only
+	// ever set, so the in-memory copy answers safely for every transaction.
+	//
+	// add() marks the pages it changes, and flush() logs just those pages in the
+	// write transaction, call it before commit_write_transaction(), and call
+	// discard() after a rollback.  flush() merges in the bits other instances have
+	// committed, so no key is lost, and counts the change in the header.
+	// Other instances, in this process or another, see new keys once they refresh().
+	// may_contain() may be called from any thread, alongside the others, which
+	// must be called by one thread at a time.  They take m_lock only to change
+	// the in-memory copy, and never hold it across I/O.
+	class BloomFilter
+	{
+	public:
+		BloomFilter(BlockStore* store);
+		~BloomFilter();
+
+		// Allocate a new, empty filter in the write transaction trans_id
+		int create(const id_t& trans_id, size_t expected_keys, size_t bits_per_key = 10);
+
+		// Load the filter as of trans_id
+		int open(const id_t& root_id, const id_t& trans_id);
+
+		// Reload the filter as of trans_id if it has changed since we loaded it,
+		// keeping our own keys.  Unchanged, it costs one read of the header.
+		int refresh(const id_t& trans_id);
+
+		const id_t& root() const
+		{
+			return m_root;
+		}
+
+		bool may_contain(const void* key, size_t length) const;
+		void add(const void* key, size_t length);
+
+		int flush(const id_t& trans_id);
+
+		// Call after rolling back trans_id.  A filter created by it is forgotten.
+		void discard(const id_t& trans_id);
+
+	private:
+		BloomFilter(const BloomFilter&);
+		BloomFilter& operator = (const BloomFilter&);
+
+		BlockStore*             m_store;
+		mutable OOBase::RWMutex m_lock;
+		id_t                    m_root;
+		size_t                  m_block_size;
+		size_t                  m_page_count;
+		size_t                  m_lines;
+		size_t                  m_probes;
+		uint64_t*               m_bits;
+		bool*                   m_dirty;
+		bool                    m_new;
+		id_t                    m_create_trans_id;
+
+		int alloc(size_t page_count);
+		void free();
+		int load(const id_t& root_id, const id_t& trans_id, bool keep);
+
+		void make_mask(const void* key, size_t length, size_t& line, uint64_t mask[8]) const;
+	};
+}
+
+#endif // OOKV_BLOOMFILTER_H_INCLUDED_
@@ -0,0 +1,109 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_HASHINDEX_H_INCLUDED_
+#define OOKV_HASHINDEX_H_INCLUDED_
+
+#include "BlockStore.h"
+
+#include <OOBase/Table.h>
+#include <OOBase/Vector.h>
+#include <OOBase/Mutex.h>
+
+namespace OOKv
+{
+	// A persistent extendible hash of 64-bit keys to 64-bit values, kept in
+	// BlockStore pages so it shares the transactions of the data it indexes.
+	// The directory is cached for the last few snapshots looked up in, so repeated
+	// lookups read just one bucket, and readers at different snapshots do not evict
+	// each other.  Lookups may run on many threads at once.  Callers with longer keys
+	// index a 64-bit hash of the key and confirm the match against the primary data.
+	//
+	// Changes made in a write transaction are held by the index until flush(),
+	// which must be called just before commit_write_transaction(); call discard()
+	// after a rollback.  Writes are single threaded, like the write transaction.
+	class HashIndex
+	{
+	public:
+		HashIndex(BlockStore* store, const id_t& root_id = 0);
+		~HashIndex();
+
+		// Allocate a new, empty index in the write transaction trans_id
+		int create(const id_t& trans_id);
+
+		// The block to remember to reopen the index
+		const id_t& root() const
+		{
+			return m_root;
+		}
+
+		bool find(const id_t& trans_id, uint64_t key, uint64_t& value, int& err);
+
+		// Insert or replace the value for key
+		int insert(const id_t& trans_id, uint64_t key, uint64_t value);
+
+		// Returns ENOENT if key is not present.  Buckets are never merged.
+		int remove(const id_t& trans_id, uint64_t key);
+
+		int flush(const id_t& trans_id);
+		void discard();
+
+	private:
+		HashIndex(const HashIndex&);
+		HashIndex& operator = (const HashIndex&);
+
+		struct Page
+		{
+			BlockStore::Block m_block;
+			bool              m_new;
+		};
+
+		BlockStore*                 m_store;
+		id_t                        m_root;
+		size_t                      m_block_size;
+		id_t                        m_write_trans_id;
+		OOBase::Table<id_t,Page>    m_dirty;
+		bool                        m_dir_dirty;
+
+		// The directory as of recent snapshots, with its pages loaded as lookups need them.
+		// Lookups copy what they need out under m_dir_lock, and never do i/o holding it.
+		struct DirSnapshot;
+		OOBase::RWMutex                   m_dir_lock;
+		OOBase::Table<id_t,DirSnapshot*>  m_dirs;
+
+		int begin_write(const id_t& trans_id);
+
+		const char* read_page(const id_t& trans_id, const id_t& block_id, BlockStore::Block& hold, int& err);
+		char* write_page(const id_t& trans_id, const id_t& block_id, int& err);
+		char* new_page(const id_t& trans_id, id_t& block_id, int& err);
+
+		id_t find_bucket(const id_t& trans_id, uint64_t hash, int& err);
+		id_t find_bucket_cached(const id_t& trans_id, uint64_t hash, int& err);
+		id_t find_bucket_uncached(const id_t& trans_id, uint64_t hash, int& err);
+		int load_directory(const id_t& snapshot);
+		void clear_directories();
+		int set_bucket(const id_t& trans_id, size_t index, const id_t& bucket_id);
+		int grow_directory(const id_t& trans_id);
+		int split(const id_t& trans_id, const id_t& bucket_id, uint64_t hash);
+	};
+}
+
+#endif // OOKV_HASHINDEX_H_INCLUDED_
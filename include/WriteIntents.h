@@ -0,0 +1,113 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_WRITEINTENTS_H_INCLUDED_
+#define OOKV_WRITEINTENTS_H_INCLUDED_
+
+#include "BlockStore.h"
+
+#include <OOBase/Mutex.h>
+#include <OOBase/Vector.h>
+
+namespace OOKv
+{
+	// Logical transactions over a BlockStore that conflict on key ranges rather
+	// than on whole blocks.  Each transaction reads a snapshot, claims the key
+	// ranges it will write, and records its changes as byte patches to blocks.
+	// At commit the patches are applied to the latest version of each block, so
+	// independent changes to a shared block, e.g. a B-tree root, are merged
+	// instead of serialising the writers.
+	//
+	// A transaction fails with EBUSY if another active transaction holds an
+	// overlapping key range, and commit() fails with EAGAIN if a transaction
+	// that committed after its snapshot wrote an overlapping key range or
+	// overlapping bytes.  Counters and other read-modify-write fields must be
+	// covered by a key range, or they will conflict on their bytes.
+	//
+	// Use one WriteIntents per store.  Key ranges are only checked against
+	// transactions of the same instance.  Anything else that commits to the
+	// store is only caught where it changed bytes a transaction patches, in
+	// which case commit() fails with EAGAIN.
+	class WriteIntents
+	{
+	public:
+		WriteIntents(BlockStore* store);
+		~WriteIntents();
+
+		struct Transaction;
+
+		Transaction* begin(int& err);
+
+		// The read transaction the transaction sees
+		const id_t& snapshot(const Transaction* trans) const;
+
+		// Claim the keys [first_key,last_key] for writing
+		int lock_range(Transaction* trans, uint64_t first_key, uint64_t last_key);
+
+		// Read from the snapshot, with the transaction's own patches applied
+		int read(Transaction* trans, const id_t& block_id, size_t offset, void* data, size_t length);
+
+		// Record a change of length bytes at offset in block_id
+		int patch(Transaction* trans, const id_t& block_id, size_t offset, const void* data, size_t length);
+
+		// Both release trans, whatever the result
+		int commit(Transaction* trans);
+		void abort(Transaction* trans);
+
+	private:
+		WriteIntents(const WriteIntents&);
+		WriteIntents& operator = (const WriteIntents&);
+
+		// What a committed transaction touched, kept while an older snapshot is active
+		struct Footprint
+		{
+			const Transaction* m_owner;
+			id_t               m_trans_id;
+			id_t               m_block_id;  // 0 for a key range
+			uint64_t           m_first;
+			uint64_t           m_last;
+		};
+
+		struct Intent
+		{
+			Transaction* m_owner;
+			uint64_t     m_first_key;
+			uint64_t     m_last_key;
+		};
+
+		BlockStore*                   m_store;
+		size_t                        m_block_size;
+
+		// Controlled by m_lock
+		OOBase::Mutex                 m_lock;
+		OOBase::Vector<Transaction*>  m_active;
+		OOBase::Vector<Intent>        m_intents;
+		OOBase::Vector<Footprint>     m_history;
+
+		bool conflicts(const Transaction* trans);
+		int apply(Transaction* trans, const id_t& trans_id);
+		int record(const Transaction* trans, const id_t& trans_id);
+		void forget(const Transaction* trans, const id_t& trans_id);
+		void release(Transaction* trans);
+	};
+}
+
+#endif // OOKV_WRITEINTENTS_H_INCLUDED_
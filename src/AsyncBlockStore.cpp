@@ -0,0 +1,305 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "config-kv.h"
+
+#include "../include/AsyncBlockStore.h"
+
+using namespace OOKv;
+
+namespace
+{
+	// How often a deferred request looks again, in case the transaction it waits
+	// on was finished on the BlockStore directly
+	const unsigned long s_retry_usecs = 10000;
+}
+
+AsyncBlockStore::AsyncBlockStore() :
+		m_store(NULL)
+{
+	m_readers.m_owner = this;
+	m_readers.m_closing = false;
+	m_readers.m_retry = false;
+	m_writer.m_owner = this;
+	m_writer.m_closing = false;
+	m_writer.m_retry = false;
+}
+
+AsyncBlockStore::~AsyncBlockStore()
+{
+	close();
+}
+
+int AsyncBlockStore::open(BlockStore* store, size_t read_threads)
+{
+	if (m_store || !store || !read_threads)
+		return EINVAL;
+
+	store->addref();
+	m_store = store;
+
+	int err = start(m_readers,read_threads);
+	if (err == 0)
+		err = start(m_writer,1);
+
+	if (err != 0)
+		close();
+
+	return err;
+}
+
+void AsyncBlockStore::close()
+{
+	if (m_store)
+	{
+		stop(m_readers);
+		stop(m_writer);
+
+		m_store->release();
+		m_store = NULL;
+	}
+}
+
+int AsyncBlockStore::start(Worker& worker, size_t threads)
+{
+	worker.m_closing = false;
+
+	for (size_t i = 0; i < threads; ++i)
+	{
+		OOBase::Thread* thread = new (std::nothrow) OOBase::Thread(false);
+		if (!thread)
+			return ERROR_OUTOFMEMORY;
+
+		int err = worker.m_threads.push_back(thread);
+		if (err == 0)
+			err = thread->run(&run,&worker);
+
+		if (err != 0)
+		{
+			if (worker.m_threads.empty() || *worker.m_threads.back() != thread)
+				delete thread;
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+void AsyncBlockStore::stop(Worker& worker)
+{
+	OOBase::Guard<OOBase::Condition::Mutex> guard(worker.m_lock);
+	worker.m_closing = true;
+	worker.m_condition.broadcast();
+	guard.release();
+
+	OOBase::Thread* thread = NULL;
+	while (worker.m_threads.pop_back(&thread))
+	{
+		thread->join();
+		delete thread;
+	}
+}
+
+int AsyncBlockStore::post(Worker& worker, const Request& req)
+{
+	if (!m_store)
+		return EINVAL;
+
+	OOBase::Guard<OOBase::Condition::Mutex> guard(worker.m_lock);
+	if (worker.m_closing)
+		return EINVAL;
+
+	int err = worker.m_queue.push(req);
+	if (err == 0)
+		worker.m_condition.signal();
+
+	return err;
+}
+
+int AsyncBlockStore::run(void* param)
+{
+	Worker* worker = static_cast<Worker*>(param);
+
+	OOBase::Guard<OOBase::Condition::Mutex> guard(worker->m_lock);
+	for (;;)
+	{
+		// Deferred requests go first once something may have finished the open transaction,
+		// then drain the queue before honouring close()
+		Request req;
+		bool deferred = false;
+		if (worker->m_retry && !worker->m_deferred.empty())
+		{
+			req = *worker->m_deferred.at(0);
+			deferred = true;
+		}
+		else if (!worker->m_queue.pop(&req))
+		{
+			if (worker->m_deferred.empty())
+			{
+				if (worker->m_closing)
+					break;
+
+				worker->m_condition.wait(worker->m_lock);
+			}
+			else if (!worker->m_closing && !worker->m_condition.wait(worker->m_lock,OOBase::Timeout(0,s_retry_usecs)))
+				worker->m_retry = true;
+			else if (worker->m_closing)
+			{
+				// Nothing is left to finish the open transaction, so give up waiting
+				worker->m_retry = true;
+			}
+			continue;
+		}
+
+		// Keep begins and checkpoints in order behind any already waiting
+		if (!deferred && (req.m_op == BeginWrite || req.m_op == Checkpoint) && !worker->m_deferred.empty() && worker->m_deferred.push_back(req) == 0)
+			continue;
+
+		bool closing = (worker->m_closing && worker->m_queue.empty());
+
+		guard.release();
+
+		bool done = worker->m_owner->execute(req,closing);
+
+		guard.acquire();
+
+		if (deferred && done)
+			worker->m_deferred.remove_at(0);
+		else if (!deferred && !done && worker->m_deferred.push_back(req) != 0)
+		{
+			// Can't wait for it
+			guard.release();
+			worker->m_owner->execute(req,true);
+			guard.acquire();
+		}
+
+		// Retry the deferred requests after anything else completes, until one has to wait again
+		worker->m_retry = done;
+	}
+
+	return 0;
+}
+
+bool AsyncBlockStore::execute(const Request& req, bool closing)
+{
+	int err = 0;
+	switch (req.m_op)
+	{
+	case GetBlock:
+		{
+			BlockStore::Block block = m_store->get_block(req.m_block_id,req.m_trans_id,err);
+			(*req.m_block_callback)(req.m_param,req.m_block_id,block,err);
+		}
+		break;
+
+	case BeginWrite:
+		{
+			// Never block the writer thread: the request that ends the open
+			// transaction may be queued behind us
+			id_t trans_id = m_store->begin_write_transaction(err,OOBase::Timeout(0,0));
+			if (err == ETIMEDOUT && !closing)
+				return false;
+
+			(*req.m_trans_callback)(req.m_param,trans_id,err);
+		}
+		break;
+
+	case UpdateBlock:
+		err = m_store->update_block(req.m_block_id,req.m_trans_id,req.m_block);
+		(*req.m_block_callback)(req.m_param,req.m_block_id,req.m_block,err);
+		break;
+
+	case CommitWrite:
+		err = m_store->commit_write_transaction(req.m_trans_id);
+		(*req.m_trans_callback)(req.m_param,req.m_trans_id,err);
+		break;
+
+	case RollbackWrite:
+		m_store->rollback_write_transaction(req.m_trans_id);
+		(*req.m_trans_callback)(req.m_param,req.m_trans_id,0);
+		break;
+
+	case Checkpoint:
+		// Like a begin, a checkpoint waits for the open transaction to finish
+		err = m_store->checkpoint(OOBase::Timeout(0,0));
+		if (err == ETIMEDOUT && !closing)
+			return false;
+
+		(*req.m_trans_callback)(req.m_param,0,err);
+		break;
+	}
+
+	return true;
+}
+
+int AsyncBlockStore::get_block(const id_t& block_id, const id_t& trans_id, BlockCallback callback, void* param)
+{
+	if (!callback)
+		return EINVAL;
+
+	Request req = { GetBlock, block_id, trans_id, BlockStore::Block(), callback, NULL, param };
+	return post(m_readers,req);
+}
+
+int AsyncBlockStore::begin_write_transaction(TransCallback callback, void* param)
+{
+	if (!callback)
+		return EINVAL;
+
+	Request req = { BeginWrite, 0, 0, BlockStore::Block(), NULL, callback, param };
+	return post(m_writer,req);
+}
+
+int AsyncBlockStore::update_block(const id_t& block_id, const id_t& trans_id, BlockStore::Block block, BlockCallback callback, void* param)
+{
+	if (!callback)
+		return EINVAL;
+
+	Request req = { UpdateBlock, block_id, trans_id, block, callback, NULL, param };
+	return post(m_writer,req);
+}
+
+int AsyncBlockStore::commit_write_transaction(const id_t& trans_id, TransCallback callback, void* param)
+{
+	if (!callback)
+		return EINVAL;
+
+	Request req = { CommitWrite, 0, trans_id, BlockStore::Block(), NULL, callback, param };
+	return post(m_writer,req);
+}
+
+int AsyncBlockStore::rollback_write_transaction(const id_t& trans_id, TransCallback callback, void* param)
+{
+	if (!callback)
+		return EINVAL;
+
+	Request req = { RollbackWrite, 0, trans_id, BlockStore::Block(), NULL, callback, param };
+	return post(m_writer,req);
+}
+
+int AsyncBlockStore::checkpoint(TransCallback callback, void* param)
+{
+	if (!callback)
+		return EINVAL;
+
+	Request req = { Checkpoint, 0, 0, BlockStore::Block(), NULL, callback, param };
+	return post(m_writer,req);
+}
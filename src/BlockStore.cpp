@@ -22,12 +22,24 @@
 #include "config-kv.h"
 
 #include <OOBase/Cache.h>
-#include <OOBase/Set.h>
+#include <OOBase/Table.h>
 #include <OOBase/Condition.h>
-#include <OOBase/CDRStream.h>
+#include <OOBase/String.h>
+#include <OOBase/Vector.h>
+#include <OOBase/Set.h>
 
 #include "../include/BlockStore.h"
 #include "File.h"
+#include "ReadRegistry.h"
+#include "SharedRegion.h"
+#include "LogBuffer.h"
+#include "Diff.h"
+#include "Varint.h"
+#include "Stats.h"
+#include "Numa.h"
+#include "Sharding.h"
+
+#include <time.h>
 
 using namespace OOKv;
 
@@ -35,6 +47,73 @@ namespace
 {
 	const size_t s_checkpoint_interval = 256;
 
+	// Blocks held by the cache, split between the NUMA node shards
+	const size_t s_cache_size = 512;
+
+	// The journal reserves disk space ahead of its end by this much, or 1/8 of its length if more
+	const uint64_t s_journal_reserve = 8 * 1024 * 1024;
+
+	const uint64_t s_store_magic = 0x45524F5453764B4Full; // "OKvSTORE"
+	const uint32_t s_store_version = 1;
+
+	// Lives at the start of block 0
+	struct StoreHeader
+	{
+		uint64_t m_magic;
+		uint32_t m_version;
+		uint32_t m_block_size;
+		id_t     m_checkpoint_transaction;
+		id_t     m_free_list_head_block;
+		id_t     m_block_count;
+		uint64_t m_generation;
+	};
+
+	// Tells one store from another, e.g. from a backup restored over it
+	uint64_t new_generation()
+	{
+		return Stats::now_ns() ^ (static_cast<uint64_t>(time(NULL)) << 32);
+	}
+
+	const uint64_t s_journal_magic = 0x4C4E524A764B4F4Full; // "OOKvJRNL"
+	const uint32_t s_journal_version = 2;
+
+	// Version 1 journals hold only Begin transactions, which we still read.
+	// Version 2 adds BeginCompact, which a version 1 reader would take for a torn tail.
+	const uint32_t s_journal_min_version = 1;
+
+	inline bool is_known_journal_version(uint32_t version)
+	{
+		return (version >= s_journal_min_version && version <= s_journal_version);
+	}
+
+	// Lives at the start of the journal, followed by the transactions.
+	// Everything is in native byte order, so a journal written on a machine of
+	// the other byte order fails the magic check rather than being misread.
+	struct JournalHeader
+	{
+		uint64_t m_magic;
+		uint32_t m_version;
+		uint32_t m_block_size;
+		id_t     m_start_transaction;
+	};
+
+	const uint64_t s_incremental_magic = 0x52434E49764B4F4Full; // "OOKvINCR"
+	const uint32_t s_incremental_version = 1;
+
+	// An incremental backup is this header followed by a Page record
+	// for each changed block, a Free record for each freed block, and a
+	// final Commit record.  Records are a uint64_t op and block id, and
+	// Page records are followed by the block.
+	struct IncrementalHeader
+	{
+		uint64_t m_magic;
+		uint32_t m_version;
+		uint32_t m_block_size;
+		id_t     m_from_transaction;
+		id_t     m_to_transaction;
+		id_t     m_block_count;
+	};
+
 	namespace LogRecord
 	{
 		enum Type
@@ -44,11 +123,49 @@ namespace
 			Free,
 			Diff,
 			Commit,
+			Page,
+			Truncate,
+
+			// Reported for the diffs of compact transactions
+			CompactDiff,
+
+			// Starts a compact transaction, whose records are a one byte op and a
+			// varint block id, and whose diffs use varint run markers
+			BeginCompact,
 
 			MAX
 		};
 	}
 
+	inline bool is_begin(uint64_t op)
+	{
+		return (op == LogRecord::Begin || op == LogRecord::BeginCompact);
+	}
+
+	// The longest a record can be: a one byte op and a varint block id
+	const size_t s_record_length = 1 + Varint::s_max_length;
+
+	// The journal's transaction length must stay below 2^63
+	const uint64_t s_max_log_length = 0x8000000000000000ull;
+
+	inline bool write_record(LogBuffer& log, LogRecord::Type op, const id_t& id)
+	{
+		unsigned char buf[s_record_length];
+		buf[0] = static_cast<unsigned char>(op);
+		return log.write(buf,1 + Varint::encode(id,buf + 1));
+	}
+
+	// Whether log has no room left for count more records with extra bytes of data,
+	// and the Commit record that ends the transaction
+	inline bool log_full(const LogBuffer& log, uint64_t count, uint64_t extra = 0)
+	{
+		if (log.length() >= s_max_log_length)
+			return true;
+
+		uint64_t room = s_max_log_length - log.length();
+		return (count >= room / s_record_length || extra > room - (count + 1) * s_record_length);
+	}
+
 	struct BlockSpan
 	{
 		id_t m_block_id;
@@ -79,67 +196,429 @@ namespace
 		}
 	};
 
+	// Call f(op,block_id,payload,length) for each record of one journal transaction body,
+	// or of a run of whole records from within one if !whole.
+	// compact says the body follows a BeginCompact header.
+	template <typename F>
+	int walk_transaction(size_t block_size, bool compact, const char* body, size_t length, F& f, bool whole = true)
+	{
+		for (size_t pos = 0;;)
+		{
+			uint64_t op;
+			id_t id;
+			if (!whole && pos == length)
+				return 0;
+
+			if (compact)
+			{
+				if (pos == length)
+					return EINVAL;
+
+				op = static_cast<unsigned char>(body[pos++]);
+				if (op == LogRecord::Commit)
+					return 0;
+
+				size_t len = Varint::decode(body + pos,length - pos,id);
+				if (!len)
+					return EINVAL;
+				pos += len;
+
+				if (op == LogRecord::Diff)
+					op = LogRecord::CompactDiff;
+			}
+			else
+			{
+				if (length - pos < sizeof(op))
+					return EINVAL;
+
+				memcpy(&op,body + pos,sizeof(op));
+				pos += sizeof(op);
+
+				if (op == LogRecord::Commit)
+					return 0;
+
+				if (length - pos < sizeof(id))
+					return EINVAL;
+
+				memcpy(&id,body + pos,sizeof(id));
+				pos += sizeof(id);
+			}
+
+			size_t payload = 0;
+			switch (op)
+			{
+			case LogRecord::Alloc:
+			case LogRecord::Free:
+			case LogRecord::Truncate:
+				break;
+
+			case LogRecord::Diff:
+				// Measure the diff without applying it
+				if ((payload = Diff::apply(block_size,NULL,body + pos,length - pos)) == 0)
+					return EINVAL;
+				break;
+
+			case LogRecord::CompactDiff:
+				if ((payload = Diff::apply_compact(block_size,NULL,body + pos,length - pos)) == 0)
+					return EINVAL;
+				break;
+
+			case LogRecord::Page:
+				if (length - pos < block_size)
+					return EINVAL;
+				payload = block_size;
+				break;
+
+			default:
+				return EINVAL;
+			}
+
+			int err = f(op,id,body + pos,payload);
+			if (err != 0)
+				return err;
+
+			pos += payload;
+		}
+	}
+
+	// Plays the records that refer to one block onto a copy of it
+	struct Replayer
+	{
+		size_t m_block_size;
+		char*  m_data;
+		id_t   m_block_id;
+		size_t m_records;
+
+		int operator ()(uint64_t op, const id_t& id, const char* payload, size_t length)
+		{
+			++m_records;
+			if (id != m_block_id)
+				return 0;
+
+			switch (op)
+			{
+			case LogRecord::Alloc:
+				memset(m_data,0,m_block_size);
+				break;
+
+			case LogRecord::Diff:
+				Diff::apply(m_block_size,m_data,payload,length);
+				break;
+
+			case LogRecord::CompactDiff:
+				Diff::apply_compact(m_block_size,m_data,payload,length);
+				break;
+
+			case LogRecord::Page:
+				memcpy(m_data,payload,m_block_size);
+				break;
+
+			default:
+				break;
+			}
+			return 0;
+		}
+	};
+
+	// Gathers the blocks touched by a shipped transaction, and the new end of the store
+	struct ShippedCollector
+	{
+		OOBase::Vector<id_t>* m_block_ids;
+		id_t                  m_block_count;
+
+		int operator ()(uint64_t op, const id_t& id, const char*, size_t)
+		{
+			if (op == LogRecord::Free)
+				return 0;
+
+			if (op == LogRecord::Truncate)
+			{
+				m_block_count = id;
+				return 0;
+			}
+
+			if (op == LogRecord::Alloc && id >= m_block_count)
+				m_block_count = id + 1;
+
+			return m_block_ids->push_back(id);
+		}
+	};
+
+	// Tracks which blocks the journal leaves free
+	struct FreeCollector
+	{
+		OOBase::Set<id_t>* m_free_blocks;
+
+		int operator ()(uint64_t op, const id_t& id, const char*, size_t)
+		{
+			switch (op)
+			{
+			case LogRecord::Free:
+				return m_free_blocks->insert(id);
+
+			case LogRecord::Truncate:
+				while (!m_free_blocks->empty() && *m_free_blocks->at(m_free_blocks->size()-1) >= id)
+					m_free_blocks->remove_at(m_free_blocks->size()-1);
+				return 0;
+
+			default:
+				m_free_blocks->remove(id);
+				return 0;
+			}
+		}
+	};
+
+	// Where a block's records lie within one journal transaction
+	struct JournalRef
+	{
+		uint64_t m_trans_offset;
+		uint64_t m_offset;
+		uint64_t m_length;
+	};
+
+	// One transaction's records of a block, copied out of the journal index
+	struct JournalEntry
+	{
+		id_t       m_trans_id;
+		JournalRef m_ref;
+	};
+
+	// Records the records of each block in one transaction for the journal index
+	struct IndexCollector
+	{
+		OOBase::Table<BlockSpan,JournalRef>* m_index;
+		id_t                                 m_trans_id;
+		uint64_t                             m_trans_offset;
+		uint64_t                             m_body_offset;
+		const char*                          m_body;
+		uint64_t                             m_next;
+
+		int operator ()(uint64_t op, const id_t& id, const char* payload, size_t length)
+		{
+			// Records follow one another, so each starts where the last ended
+			uint64_t start = m_next;
+			uint64_t end = m_body_offset + static_cast<uint64_t>(payload - m_body) + length;
+			m_next = end;
+
+			if (op == LogRecord::Free || op == LogRecord::Truncate)
+				return 0;
+
+			JournalRef* ref = m_index->find(BlockSpan(id,m_trans_id));
+			if (ref)
+			{
+				ref->m_length = end - ref->m_offset;
+				return 0;
+			}
+
+			JournalRef new_ref = { m_trans_offset, start, end - start };
+			return m_index->insert(BlockSpan(id,m_trans_id),new_ref);
+		}
+	};
+
+	// Gathers the ids of blocks with new versions, and the end of the store after them
+	struct BlockCollector
+	{
+		OOBase::Set<id_t>* m_blocks;
+		id_t               m_block_count;
+
+		int operator ()(uint64_t op, const id_t& id, const char*, size_t)
+		{
+			if (op == LogRecord::Truncate)
+				m_block_count = id;
+			else if (op == LogRecord::Alloc && id >= m_block_count)
+				m_block_count = id + 1;
+
+			if (op == LogRecord::Free || op == LogRecord::Truncate || m_blocks->exists(id))
+				return 0;
+
+			return m_blocks->insert(id);
+		}
+	};
+
+	// The blocks changed and freed since an incremental backup's starting point
+	struct IncrementalCollector
+	{
+		BlockCollector m_changed;
+		FreeCollector  m_freed;
+
+		int operator ()(uint64_t op, const id_t& id, const char* data, size_t len)
+		{
+			int err = m_changed(op,id,data,len);
+			if (err == 0)
+				err = m_freed(op,id,data,len);
+			return err;
+		}
+	};
+
+	// The block cache is split per NUMA node, each with its own lock.
+	// The padding keeps one shard's lock off the cache line of the next.
+	struct CacheShard
+	{
+		CacheShard(size_t size) : m_cache(size)
+		{}
+
+		OOBase::RWMutex                                       m_lock;
+		OOBase::TableCache<BlockSpan,OOKv::BlockStore::Block> m_cache;
+		char                                                  m_pad[s_cache_line];
+	};
+
 	class BlockStoreBase : public OOKv::BlockStore
 	{
 	public:
 		BlockStoreBase();
+		virtual ~BlockStoreBase();
 
-		virtual int open_i(const char* path) = 0;
+		virtual int open_i(const char* path, size_t block_size) = 0;
 
-		int load(const char* path, bool read_only);
+		int load(const char* path, bool read_only, size_t block_size);
 
-		virtual Block load_block(const id_t& block_id, id_t& start_trans_id, int& err);
+		size_t block_size() const
+		{
+			return m_block_size;
+		}
+
+		Block load_block(const id_t& block_id, int& err);
+
+		Block new_block(int& err);
+
+		// The last transaction any process has committed
+		const volatile id_t& visible_transaction() const;
 
 		id_t begin_read_transaction(int& err);
 		int end_read_transaction(const id_t& trans_id);
 
 		Block get_block(const id_t& block_id, const id_t& trans_id, int& err);
 
-		int validate_checkpoint_file(File& file);
+		// Bring block, the version at span, forward to trans_id, loading it if need be
+		int play_forward(Block& block, BlockSpan& span, const id_t& trans_id);
+
+		// Pin the checkpoint while the store file and the journal are read together.
+		// first is the last transaction in the store file, when it had block_count blocks.
+		// end_checkpoint_read() returns false if the checkpoint moved anyway,
+		// and the reads must be repeated.
+		virtual int begin_checkpoint_read(id_t& first, id_t& block_count);
+		virtual bool end_checkpoint_read(const id_t& first);
+
+		void get_stats(Statistics& stats) const;
+
+		int read_extent(const id_t& block_id, const id_t& trans_id, size_t offset, void* data, size_t length);
+
+		int backup(const char* path, const id_t& since_trans_id, id_t& trans_id);
+#if !defined(_WIN32)
+		int backup(int fd, const id_t& since_trans_id, id_t& trans_id);
+#endif
+
+		int replicate(id_t& last_trans_id, const OOBase::Timeout& timeout = OOBase::Timeout()) { return EINVAL; }
+
+		// Start an empty journal, following on from m_first_transaction
+		int write_journal_header();
+
+		// Find the committed transactions in the journal, and what they do to the store.
+		// start is the first transaction after m_first_transaction, and end follows the
+		// last complete one.
+		int recover_journal(uint64_t& start, uint64_t& end);
 
 		// Persistent data
 		id_t m_last_transaction;
 		id_t m_first_transaction;
 		id_t m_free_list_head_block;
+		id_t m_block_count;
+
+		// The store file holds every transaction up to m_first_transaction, when it
+		// had m_store_block_count blocks.  Readers hold m_checkpoint_lock shared while
+		// they combine the store file with the journal, so a checkpoint can't move
+		// either under them.
+		OOBase::RWMutex                     m_checkpoint_lock;
+		id_t                                m_store_block_count;
+
+		// Volatile data - lock-free, and shared with other processes if m_shared is open
+		ReadRegistry                        m_read_transactions;
+		SharedRegion                        m_shared;
+
+		// Volatile data - lock-free
+		Stats                               m_stats;
+
+		// Volatile data - each shard controlled by its own lock
+		NumaTopology                        m_topology;
+		CacheShard*                         m_cache[NumaTopology::s_max_nodes];
 
 		// Volatile data - controlled by m_lock
 		OOBase::RWMutex                     m_lock;
-		OOBase::Set<id_t>                   m_read_transactions;
-		OOBase::TableCache<BlockSpan,Block> m_cache;
+		OOBase::Table<id_t,id_t>            m_journal_blocks;
+		bool                                m_journal_indexed;
 
-		// Volatile data - controlled by m_journal lock
-		OOBase::SpinLock                    m_journal_lock;
+		// Volatile data - controlled by m_journal_lock, which is held across file I/O
+		OOBase::Mutex                       m_journal_lock;
 		File                                m_journal_file;
 		uint64_t                            m_journal_start;
 
 		// Uncontrolled data - init'd at load()
+		size_t                              m_block_size;
 		Directory                           m_store_directory;
 		File                                m_store_file;
 		OOBase::String                      m_store_name;
 
+		// Call f for each record of the journal transactions in (from,to],
+		// and return where the transaction after to starts in end_pos
+		template <typename F>
+		int scan_journal(const id_t& from, const id_t& to, F& f, size_t& transactions, uint64_t* end_pos = NULL);
+
+		virtual int apply_journal(Block& block, const BlockSpan& from, const id_t& to);
+
+		// False if the journal certainly has no version of block_id at or before trans_id
+		virtual bool in_journal(const id_t& block_id, const id_t& trans_id);
+
+		// Cache a version of a block on the calling thread's node
+		void cache_insert(const BlockSpan& span, const Block& block);
+
 	private:
-		int apply_journal(Block& block, const BlockSpan& from, const id_t& to);
+		int backup_i(File& dest, const id_t& since_trans_id, id_t& trans_id);
+		int backup_full(File& dest, const OOBase::Set<id_t>& changed, const id_t& trans_id, const id_t& block_count);
+		int backup_incremental(File& dest, const OOBase::Set<id_t>& changed, const OOBase::Set<id_t>& freed, const id_t& since_trans_id, const id_t& trans_id, const id_t& block_count);
 	};
 
 	class BlockStoreRO : public BlockStoreBase
 	{
 	public:
-		int open_i(const char* path);
+		BlockStoreRO();
 
-		Block load_block(const id_t& block_id, id_t& start_trans_id, int& err);
+		int open_i(const char* path, size_t block_size);
 
 		id_t begin_write_transaction(int& err, const OOBase::Timeout& timeout = OOBase::Timeout()) { err=EROFS; return 0;}
 		int commit_write_transaction(const id_t& trans_id) { return EROFS; }
 		void rollback_write_transaction(const id_t& trans_id) {}
 
 		int checkpoint(const OOBase::Timeout& timeout = OOBase::Timeout()) { return EROFS; }
+		void set_commit_sync(bool sync) {}
 
 		int update_block(const id_t& block_id, const id_t& trans_id, Block block) { return EROFS; }
 		id_t alloc_block(const id_t& trans_id, Block& block, int& err) { err=EROFS; return 0; }
 		int free_block(const id_t& block_id, const id_t& trans_id) { return EROFS; }
 
+		id_t alloc_extent(const id_t& trans_id, size_t block_count, int& err) { err=EROFS; return 0; }
+		int write_extent(const id_t& block_id, const id_t& trans_id, size_t offset, const void* data, size_t length) { return EROFS; }
+
+		int compact(const id_t& trans_id, RelocateCallback callback, void* param) { return EROFS; }
+
+		int restore(const char* path) { return EROFS; }
+
+	protected:
+		int apply_journal(Block& block, const BlockSpan& from, const id_t& to);
+		bool in_journal(const id_t& block_id, const id_t& trans_id);
+
+		// The writer checkpoints behind our back, so read the store header each time
+		int begin_checkpoint_read(id_t& first, id_t& block_count);
+		bool end_checkpoint_read(const id_t& first);
+
 	private:
-		File m_checkpoint_file;
+		// Built on demand: which journal transactions touch each block, up to m_index_trans
+		OOBase::Mutex                       m_index_lock;
+		OOBase::Table<BlockSpan,JournalRef> m_journal_index;
+		id_t                                m_index_trans;
+		uint64_t                            m_index_end;
+
+		int extend_index(const id_t& to);
+		void reset_index();
 	};
 
 	class BlockStoreRW : public BlockStoreBase
@@ -148,36 +627,97 @@ namespace
 		BlockStoreRW();
 		~BlockStoreRW();
 
-		int open_i(const char* path);
+		int open_i(const char* path, size_t block_size);
 
 		id_t begin_write_transaction(int& err, const OOBase::Timeout& timeout = OOBase::Timeout());
 		int commit_write_transaction(const id_t& trans_id);
 		void rollback_write_transaction(const id_t& trans_id);
 
 		int checkpoint(const OOBase::Timeout& timeout = OOBase::Timeout());
+		void set_commit_sync(bool sync);
 
 		int update_block(const id_t& block_id, const id_t& trans_id, Block block);
 		id_t alloc_block(const id_t& trans_id, Block& block, int& err);
 		int free_block(const id_t& block_id, const id_t& trans_id);
 
-	private:
+		id_t alloc_extent(const id_t& trans_id, size_t block_count, int& err);
+		int write_extent(const id_t& block_id, const id_t& trans_id, size_t offset, const void* data, size_t length);
+
+		int compact(const id_t& trans_id, RelocateCallback callback, void* param);
+
+		int restore(const char* path);
+
+	protected:
 		// Volatile data - controlled by m_write_lock
 		OOBase::Condition::Mutex       m_write_lock;
 		OOBase::Condition              m_write_condition;
 		bool                           m_write_inprogress;
-		OOBase::CDRStream              m_log;
+		bool                           m_commit_sync;
+		LogBuffer                      m_log;
+		void*                          m_log_length;
+		OOBase::Vector<Block>          m_log_blocks;
+		OOBase::Vector<id_t>           m_log_block_ids;
+		OOBase::Vector<id_t>           m_log_free_ids;
+
+		// The latest version of each block this transaction has written,
+		// or an empty Block if it has freed it
+		OOBase::Table<id_t,Block>      m_log_versions;
+		id_t                           m_trans_block_count;
+		id_t                           m_trans_alloc_first;
+
+		// Blocks free as of the last commit
+		OOBase::Set<id_t>              m_free_blocks;
+
+		// Volatile data - controlled by m_journal_lock
+		uint64_t                       m_journal_reserved;
+
+		void reset_log();
+		int set_version(const id_t& block_id, const Block& block);
+		void update_free_blocks();
+		int append_transaction(const File::IOBuffer* buffers, size_t count, const id_t& trans_id, const id_t& block_count, const OOBase::Vector<id_t>& block_ids);
 
 		int do_checkpoint();
-		int apply_checkpoint(File& checkpoint_file, bool validate);
+
+	private:
+		int restore_i(File& src, const IncrementalHeader& header);
+		int restore_records(File& src, const IncrementalHeader& header, bool apply, OOBase::Vector<id_t>& pages, OOBase::Vector<id_t>& freed);
+	};
+
+	// A BlockStoreRW whose transactions come from another store's journal
+	class BlockStoreReplica : public BlockStoreRW
+	{
+	public:
+		BlockStoreReplica();
+		~BlockStoreReplica();
+
+		int open_source(const char* source);
+
+		id_t begin_write_transaction(int& err, const OOBase::Timeout& timeout = OOBase::Timeout()) { err=EROFS; return 0;}
+
+		// Our blocks only ever come from the primary
+		int restore(const char* path) { return EROFS; }
+
+		int replicate(id_t& last_trans_id, const OOBase::Timeout& timeout = OOBase::Timeout());
+
+	private:
+		File   m_source;
+		bool   m_source_seekable;
+		id_t   m_source_start;
+		char*  m_pending;
+		size_t m_pending_len;
+		size_t m_pending_size;
+
+		int check_source(bool& restarted);
+		int apply_shipped(const char* data, size_t length);
 	};
 
 	template <typename T>
-	OOKv::BlockStore* open_t(const char* path, int& err)
+	OOKv::BlockStore* open_t(const char* path, size_t block_size, int& err)
 	{
 		T* store = new (std::nothrow) T();
 		if (!store)
 			err = ERROR_OUTOFMEMORY;
-		else if ((store->open_i(path)) != 0)
+		else if ((err = store->open_i(path,block_size)) != 0)
 		{
 			store->release();
 			store = NULL;
@@ -187,26 +727,77 @@ namespace
 	}
 }
 
-OOKv::BlockStore* OOKv::BlockStore::open(const char* path, bool read_only, int& err)
+OOKv::BlockStore* OOKv::BlockStore::open(const char* path, bool read_only, int& err, size_t block_size)
 {
+	if (!Diff::is_valid_block_size(block_size))
+	{
+		err = EINVAL;
+		return NULL;
+	}
+
 	if (read_only)
-		return open_t<BlockStoreRO>(path,err);
+		return open_t<BlockStoreRO>(path,block_size,err);
 	else
-		return open_t<BlockStoreRW>(path,err);
+		return open_t<BlockStoreRW>(path,block_size,err);
+}
+
+OOKv::BlockStore* OOKv::BlockStore::open_replica(const char* path, const char* source, int& err, size_t block_size)
+{
+	if (!Diff::is_valid_block_size(block_size))
+	{
+		err = EINVAL;
+		return NULL;
+	}
+
+	BlockStoreReplica* store = static_cast<BlockStoreReplica*>(open_t<BlockStoreReplica>(path,block_size,err));
+	if (store && (err = store->open_source(source)) != 0)
+	{
+		store->release();
+		store = NULL;
+	}
+
+	return store;
 }
 
 BlockStoreBase::BlockStoreBase() :
-		m_cache(512)
+		m_last_transaction(0),
+		m_first_transaction(0),
+		m_free_list_head_block(0),
+		m_block_count(1),
+		m_store_block_count(1),
+		m_journal_indexed(false),
+		m_journal_start(0),
+		m_block_size(s_default_block_size)
+{
+	memset(m_cache,0,sizeof(m_cache));
+}
+
+BlockStoreBase::~BlockStoreBase()
 {
+	for (size_t i = 0; i < NumaTopology::s_max_nodes; ++i)
+		delete m_cache[i];
 }
 
-int BlockStoreBase::load(const char* path, bool read_only)
+int BlockStoreBase::load(const char* path, bool read_only, size_t block_size)
 {
+	// One cache per NUMA node, so hits stay on the local node.
+	// The shards share the capacity, so more nodes does not mean more memory
+	m_topology.init();
+	size_t shard_size = s_cache_size / m_topology.node_count();
+	for (size_t i = 0; i < m_topology.node_count(); ++i)
+	{
+		m_cache[i] = new (std::nothrow) CacheShard(shard_size ? shard_size : 1);
+		if (!m_cache[i])
+			return ERROR_OUTOFMEMORY;
+	}
+
 	// Build the relative filenames...
-	OOBase::LocalString dir_name, journal_name, checkpoint_name;
+	OOBase::LocalString dir_name, journal_name, lock_name;
 	int err = OOBase::Paths::SplitDirAndFilename(path,dir_name,m_store_name);
 	if (err == 0)
 		err = journal_name.concat(m_store_name.c_str(),".journal");
+	if (err == 0)
+		err = lock_name.concat(m_store_name.c_str(),".lock");
 	if (err != 0)
 		return err;
 
@@ -215,87 +806,270 @@ int BlockStoreBase::load(const char* path, bool read_only)
 		return err;
 
 	// Open store
-	m_store_file = m_store_directory.open_file(m_store_name.c_str(),read_only,err);
+	if (read_only || m_store_directory.file_exists(m_store_name.c_str()))
+		m_store_file = m_store_directory.open_file(m_store_name.c_str(),read_only,err);
+	else
+		m_store_file = m_store_directory.create_file(m_store_name.c_str(),false,err);
+	if (err != 0)
+		return err;
+
+	// Read the header, which fixes the block size for the life of the store
+	StoreHeader header = {0};
+	size_t len = m_store_file.read_at(0,&header,sizeof(header),err);
 	if (err != 0)
 		return err;
 
+	if (len == 0)
+	{
+		// A brand new store
+		header.m_magic = s_store_magic;
+		header.m_version = s_store_version;
+		header.m_block_size = static_cast<uint32_t>(block_size);
+		header.m_block_count = 1;
+		header.m_generation = new_generation();
+
+		if (!read_only)
+		{
+			if ((err = m_store_file.seek_begin(0)) != 0 ||
+					(err = m_store_file.write(&header,sizeof(header))) != 0 ||
+					(err = m_store_file.sync()) != 0)
+			{
+				return err;
+			}
+		}
+	}
+	else if (len < sizeof(header) ||
+			header.m_magic != s_store_magic ||
+			header.m_version != s_store_version ||
+			!Diff::is_valid_block_size(header.m_block_size))
+	{
+		return EINVAL;
+	}
+
+	m_block_size = header.m_block_size;
+	m_first_transaction = header.m_checkpoint_transaction;
+	m_last_transaction = header.m_checkpoint_transaction;
+	m_free_list_head_block = header.m_free_list_head_block;
+	m_block_count = header.m_block_count;
+	m_store_block_count = header.m_block_count;
+
+	// Map the shared region so other processes see our readers and cache,
+	// falling back to a private reader table if we can't, e.g. on read-only media.
+	// Only the writer checkpoints, so only it may overflow the shared table.
+	if (m_shared.open(m_store_directory,lock_name.c_str(),m_block_size,header.m_generation) == 0)
+		m_read_transactions.attach(m_shared.reader_slots(),m_shared.reader_count(),!read_only);
+	else if ((err = m_read_transactions.init()) != 0)
+		return err;
+
 	// Check for journal file
 	if (m_store_directory.file_exists(journal_name.c_str()))
 		m_journal_file = m_store_directory.open_file(journal_name.c_str(),read_only,err);
 	else if (!read_only)
 		m_journal_file = m_store_directory.create_file(journal_name.c_str(),false,err);
 
-	// Init m_journal_start from the store m_first_transaction
-	void* TODO;
+	if (err == 0 && m_journal_file.is_open())
+	{
+		JournalHeader journal_header = {0};
+		len = m_journal_file.read_at(0,&journal_header,sizeof(journal_header),err);
+		if (err == 0)
+		{
+			if (len == 0 && !read_only)
+				err = write_journal_header();
+			else if (len != 0 && (len != sizeof(journal_header) ||
+					journal_header.m_magic != s_journal_magic ||
+					!is_known_journal_version(journal_header.m_version) ||
+					journal_header.m_block_size != m_block_size))
+			{
+				err = EINVAL;
+			}
+		}
+	}
+
+	m_journal_start = sizeof(JournalHeader);
 
 	return err;
 }
 
-OOKv::id_t BlockStoreBase::begin_read_transaction(int& err)
+int BlockStoreBase::write_journal_header()
 {
-	OOBase::Guard<OOBase::RWMutex> guard(m_lock);
-
-	err = m_read_transactions.insert(m_last_transaction);
-	if (err != 0)
-		return 0;
-
-	return m_last_transaction;
+	JournalHeader header = { s_journal_magic, s_journal_version, static_cast<uint32_t>(m_block_size), m_first_transaction };
+	return m_journal_file.write_at(0,&header,sizeof(header));
 }
 
-int BlockStoreBase::end_read_transaction(const id_t& trans_id)
+int BlockStoreBase::recover_journal(uint64_t& start, uint64_t& end)
 {
-	OOBase::Guard<OOBase::RWMutex> guard(m_lock);
+	// Caller must be opening the store, so nothing else is using it yet
+	start = end = sizeof(JournalHeader);
 
-	return m_read_transactions.remove(trans_id);
-}
+	m_journal_blocks.clear();
+	m_journal_indexed = true;
 
-BlockStore::Block BlockStoreBase::load_block(const id_t& block_id, id_t& start_trans_id, int& err)
-{
-	// Load the block data from the store
-	void* TODO;
+	if (!m_journal_file.is_open())
+		return 0;
 
-	return Block();
-}
+	uint64_t journal_len = 0;
+	int err = m_journal_file.length(journal_len);
+	if (err != 0)
+		return err;
 
-BlockStore::Block BlockStoreBase::get_block(const id_t& block_id, const id_t& trans_id, int& err)
-{
-	if (trans_id > m_last_transaction || block_id == 0 || trans_id == 0)
+	char* body = NULL;
+	size_t body_size = 0;
+	OOBase::Vector<id_t> block_ids;
+
+	for (;;)
 	{
-		err = EINVAL;
-		return Block();
-	}
+		uint64_t header[3];
+		size_t len = m_journal_file.read_at(end,header,sizeof(header),err);
+		if (err != 0 || len < sizeof(header))
+			break;
 
-	OOBase::ReadGuard<OOBase::RWMutex> read_guard(m_lock);
+		// Anything incomplete, or out of sequence, is the tail of a commit that never finished
+		if (!is_begin(header[0]) || header[2] == 0 || header[2] > journal_len - end - sizeof(header))
+			break;
+
+		uint64_t next = end + sizeof(header) + header[2];
+
+		if (header[1] <= m_first_transaction)
+		{
+			// Already in the store, left behind by a checkpoint that didn't finish
+			start = end = next;
+			continue;
+		}
+
+		if (header[1] != m_last_transaction+1)
+			break;
+
+		if (header[2] > body_size)
+		{
+			char* new_body = static_cast<char*>(OOBase::HeapAllocator::reallocate(body,static_cast<size_t>(header[2])));
+			if (!new_body)
+			{
+				err = ERROR_OUTOFMEMORY;
+				break;
+			}
+			body = new_body;
+			body_size = static_cast<size_t>(header[2]);
+		}
+
+		len = m_journal_file.read_at(end + sizeof(header),body,static_cast<size_t>(header[2]),err);
+		if (err != 0 || len != header[2])
+			break;
+
+		block_ids.clear();
+		ShippedCollector collector = { &block_ids, m_block_count };
+		if (walk_transaction(m_block_size,header[0] == LogRecord::BeginCompact,body,len,collector) != 0)
+			break;
+
+		m_last_transaction = header[1];
+		m_block_count = collector.m_block_count;
+
+		for (size_t i = 0; i < block_ids.size(); ++i)
+		{
+			if (!m_journal_blocks.exists(*block_ids.at(i)) && m_journal_blocks.insert(*block_ids.at(i),header[1]) != 0)
+				m_journal_indexed = false;
+		}
+
+		end = next;
+	}
+
+	OOBase::HeapAllocator::free(body);
+
+	return err;
+}
+
+const volatile OOKv::id_t& BlockStoreBase::visible_transaction() const
+{
+	if (m_shared.is_open())
+		return m_shared.last_transaction();
+
+	return m_last_transaction;
+}
+
+OOKv::id_t BlockStoreBase::begin_read_transaction(int& err)
+{
+	return m_read_transactions.acquire(visible_transaction(),err);
+}
+
+int BlockStoreBase::end_read_transaction(const id_t& trans_id)
+{
+	return m_read_transactions.release(trans_id);
+}
+
+BlockStore::Block BlockStoreBase::load_block(const id_t& block_id, int& err)
+{
+	// Load the block data from the store
+	Block block = new_block(err);
+	if (err != 0)
+		return Block();
+
+	// Blocks past the end of the store have not been checkpointed yet
+	void* data = block;
+	size_t len = m_store_file.read_at(block_id * m_block_size,data,m_block_size,err);
+	if (err != 0)
+		return Block();
+
+	memset(static_cast<char*>(data) + len,0,m_block_size - len);
+
+	return block;
+}
+
+BlockStore::Block BlockStoreBase::new_block(int& err)
+{
+	void* data = OOBase::HeapAllocator::allocate(m_block_size);
+	if (!data)
+	{
+		err = ERROR_OUTOFMEMORY;
+		return Block();
+	}
+
+	return Block(data);
+}
+
+BlockStore::Block BlockStoreBase::get_block(const id_t& block_id, const id_t& trans_id, int& err)
+{
+	if (trans_id > visible_transaction() || block_id == 0 || trans_id == 0)
+	{
+		err = EINVAL;
+		return Block();
+	}
+
+	size_t node = m_topology.current_node();
+	CacheShard* local = m_cache[node];
+
+	OOBase::ReadGuard<OOBase::RWMutex> read_guard(local->m_lock);
 
 	BlockSpan span(block_id,0);
 	Block block;
 
 	// This is a prefix lookup, that will land somewhere in the set of transactions in the cache
-	size_t pos = m_cache.find_at(block_id);
-	if (pos != m_cache.npos)
+	size_t pos = local->m_cache.find_at(block_id);
+	if (pos != local->m_cache.npos)
 	{
 		// If we find an entry then we need to shuffle forwards and back until we hit the nearest
-		for (;pos < m_cache.size()-1; ++pos)
+		for (;pos < local->m_cache.size()-1; ++pos)
 		{
-			const BlockSpan* b = m_cache.key_at(pos+1);
+			const BlockSpan* b = local->m_cache.key_at(pos+1);
 			if (b->m_block_id != block_id || b->m_start_trans_id >= trans_id)
 				break;
 		}
 
 		for (;pos > 0; --pos)
 		{
-			const BlockSpan* b = m_cache.key_at(pos-1);
+			const BlockSpan* b = local->m_cache.key_at(pos-1);
 			if (b->m_block_id != block_id || b->m_start_trans_id <= trans_id)
 				break;
 		}
 
-		span = *m_cache.key_at(pos);
+		span = *local->m_cache.key_at(pos);
 
 		if (span.m_start_trans_id <= trans_id)
 		{
-			block = *m_cache.at(pos);
+			block = *local->m_cache.at(pos);
 			if (span.m_start_trans_id == trans_id)
+			{
+				m_stats.add(Stats::GetBlockHits);
 				return block;
+			}
 		}
 		else
 			span.m_start_trans_id = 0;
@@ -303,352 +1077,1495 @@ BlockStore::Block BlockStoreBase::get_block(const id_t& block_id, const id_t& tr
 
 	read_guard.release();
 
-	if (!block)
+	// Another node may have the exact version, move it to our shard so the next hit is local.
+	// Only one shard holds each version, so the cache does not fill with copies
+	for (size_t i = 1; i < m_topology.node_count(); ++i)
 	{
-		// Load up the first block in the file
-		block = load_block(block_id,span.m_start_trans_id,err);
-		if (err != 0)
-			return Block();
+		CacheShard* remote = m_cache[(node + i) % m_topology.node_count()];
+
+		Block remote_block;
+		OOBase::Guard<OOBase::RWMutex> remote_guard(remote->m_lock);
+		if (remote->m_cache.remove(BlockSpan(block_id,trans_id),&remote_block))
+		{
+			remote_guard.release();
+
+			m_stats.add(Stats::RemoteCacheHits);
+			cache_insert(BlockSpan(block_id,trans_id),remote_block);
+			return remote_block;
+		}
 	}
 
-	// Play forward journal till trans_id
-	if (span.m_start_trans_id < trans_id)
+	m_stats.add(Stats::GetBlockMisses);
+
+	if (!block && m_shared.is_open())
 	{
-		err = apply_journal(block,span,trans_id);
+		// Another process may have already built a version we can start from
+		Block shared_block = new_block(err);
 		if (err != 0)
 			return Block();
 
-		span.m_start_trans_id = trans_id;
+		if (m_shared.cache_find(block_id,trans_id,span.m_start_trans_id,shared_block))
+		{
+			m_stats.add(Stats::SharedCacheHits);
+			block = shared_block;
+		}
+		else
+			span.m_start_trans_id = 0;
 	}
 
-	OOBase::Guard<OOBase::RWMutex> write_guard(m_lock);
+	if ((err = play_forward(block,span,trans_id)) != 0)
+		return Block();
+
+	// Share the committed version with other processes
+	if (m_shared.is_open())
+		m_shared.cache_insert(block_id,span.m_start_trans_id,block);
 
 	// Add the block to the cache
-	m_cache.insert(span,block);
+	cache_insert(span,block);
 	return block;
 }
 
-int BlockStoreBase::validate_checkpoint_file(File& file)
+int BlockStoreBase::play_forward(Block& block, BlockSpan& span, const id_t& trans_id)
 {
-	void* TODO;
-
-	return 0;
-}
+	for (;;)
+	{
+		id_t first = 0;
+		id_t block_count = 0;
+		int err = begin_checkpoint_read(first,block_count);
+		if (err != 0)
+			return err;
 
-int BlockStoreRO::open_i(const char* path)
-{
-	int err = load(path,true);
-	if (err != 0)
-		return err;
+		Block version = block;
+		BlockSpan version_span = span;
 
-	// Open checkpoint in case the BlockStore crashed during a checkpoint
-	OOBase::LocalString checkpoint_name;
-	if ((err = checkpoint_name.concat(m_store_name.c_str(),".checkpoint")) != 0)
-		return err;
+		// The journal no longer holds the transactions between an older version and the checkpoint
+		if (trans_id < first)
+			err = ESTALE;
+		else if (!version || version_span.m_start_trans_id < first)
+		{
+			// Load up the block from the store file.  Replaying the journal over a
+			// page the checkpoint has already written is harmless, as every record
+			// replaces bytes rather than modifying them.
+			version = load_block(version_span.m_block_id,err);
+			version_span.m_start_trans_id = first;
+		}
 
-	if (m_store_directory.file_exists(checkpoint_name.c_str()))
-	{
-		m_checkpoint_file = m_store_directory.open_file(checkpoint_name.c_str(),true,err);
+		// Play forward journal till trans_id
+		if (err == 0 && version_span.m_start_trans_id < trans_id)
+		{
+			if ((err = apply_journal(version,version_span,trans_id)) == 0)
+				version_span.m_start_trans_id = trans_id;
+		}
 
-		// Validate checkpoint file...
-		err = validate_checkpoint_file(m_checkpoint_file);
+		if (end_checkpoint_read(first) || err != 0)
+		{
+			if (err == 0)
+			{
+				block = version;
+				span = version_span;
+			}
+			return err;
+		}
 	}
-
-	return err;
 }
 
-BlockStore::Block BlockStoreRO::load_block(const id_t& block_id, id_t& start_trans_id, int& err)
+int BlockStoreBase::begin_checkpoint_read(id_t& first, id_t& block_count)
 {
-	Block block = BlockStoreBase::load_block(block_id,start_trans_id,err);
-	if (err == 0 && block && m_checkpoint_file.is_open())
-	{
-		// Play through checkpoint file in case we have a read-only crashed store
+	m_checkpoint_lock.acquire_read();
 
-		void* TODO;
-	}
+	first = m_first_transaction;
+	block_count = m_store_block_count;
+	return 0;
+}
 
-	return block;
+bool BlockStoreBase::end_checkpoint_read(const id_t&)
+{
+	m_checkpoint_lock.release_read();
+	return true;
 }
 
-BlockStoreRW::BlockStoreRW() : BlockStoreBase(),
-		m_write_inprogress(false)
+void BlockStoreBase::cache_insert(const BlockSpan& span, const Block& block)
 {
+	CacheShard* local = m_cache[m_topology.current_node()];
+
+	OOBase::Guard<OOBase::RWMutex> guard(local->m_lock);
+	local->m_cache.insert(span,block);
 }
 
-BlockStoreRW::~BlockStoreRW()
+template <typename F>
+int BlockStoreBase::scan_journal(const id_t& from, const id_t& to, F& f, size_t& transactions, uint64_t* end_pos)
 {
-	if (checkpoint() == 0)
+	int err = 0;
+	char* body = NULL;
+	size_t body_size = 0;
+
+	OOBase::Guard<OOBase::Mutex> journal_guard(m_journal_lock);
+
+	uint64_t pos = m_journal_start;
+	for (;;)
 	{
-		if (m_journal_file.is_open())
+		// Each transaction starts with a Begin record: op, trans_id and length
+		uint64_t header[3];
+		size_t len = m_journal_file.read_at(pos,header,sizeof(header),err);
+		if (err != 0 || len < sizeof(header))
+			break;
+
+		if (!is_begin(header[0]))
 		{
-			m_journal_file.unlock();
-			m_journal_file.close();
+			err = EINVAL;
+			break;
 		}
 
-		// Remove the journal file
-		OOBase::LocalString journal_name;
-		if (journal_name.concat(m_store_name.c_str(),".journal") == 0)
-			m_store_directory.remove_file(journal_name.c_str());
-	}
-}
-
-int BlockStoreRW::open_i(const char* path)
-{
-	int err = load(path,false);
-	if (err != 0)
-		return err;
+		if (header[1] > to)
+			break;
 
-	// Attempt to gain exclusive lock on journal file
-	err = m_journal_file.lock();
-	if (err != 0)
-		return err;
+		if (header[1] > from)
+		{
+			if (header[2] > body_size)
+			{
+				char* new_body = static_cast<char*>(OOBase::HeapAllocator::reallocate(body,static_cast<size_t>(header[2])));
+				if (!new_body)
+				{
+					err = ERROR_OUTOFMEMORY;
+					break;
+				}
+				body = new_body;
+				body_size = static_cast<size_t>(header[2]);
+			}
 
-	// Apply checkpoint in case the BlockStore crashed during a checkpoint
-	OOBase::LocalString checkpoint_name;
-	if ((err = checkpoint_name.concat(m_store_name.c_str(),".checkpoint")) != 0)
-		return err;
+			len = m_journal_file.read_at(pos + sizeof(header),body,static_cast<size_t>(header[2]),err);
+			if (err == 0 && len != header[2])
+				err = EINVAL;
 
-	if (m_store_directory.file_exists(checkpoint_name.c_str()))
-	{
-		File checkpoint_file = m_store_directory.open_file(checkpoint_name.c_str(),true,err);
-		if (err != 0)
-			return err;
+			if (err == 0)
+				err = walk_transaction(m_block_size,header[0] == LogRecord::BeginCompact,body,len,f);
 
-		if ((err = apply_checkpoint(checkpoint_file,true)) != 0)
-			return err;
+			if (err != 0)
+				break;
 
-		checkpoint_file.close();
+			++transactions;
+		}
 
-		m_store_directory.remove_file(checkpoint_name.c_str());
+		pos += sizeof(header) + header[2];
 	}
 
-	// Do a checkpoint and ignore errors, the store is safe anyway
-	do_checkpoint();
+	journal_guard.release();
+
+	OOBase::HeapAllocator::free(body);
+
+	if (end_pos)
+		*end_pos = pos;
 
 	return err;
 }
 
-OOKv::id_t BlockStoreRW::begin_write_transaction(int& err, const OOBase::Timeout& timeout)
+void BlockStoreBase::get_stats(Statistics& stats) const
 {
-	// Acquire the lock with a timeout
-	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock,false);
-	if (!guard.acquire(timeout))
-	{
-		err = ETIMEDOUT;
-		return 0;
-	}
-
-	while (m_write_inprogress)
-	{
-		if (!m_write_condition.wait(m_write_lock,timeout))
-		{
-			err = ETIMEDOUT;
-			return 0;
-		}
-	}
+	m_stats.collect(stats);
+}
 
-	err = m_log.reset();
+int BlockStoreBase::apply_journal(Block& block, const BlockSpan& from, const id_t& to)
+{
+	// Cached blocks are shared, so play forward a private copy
+	int err = 0;
+	Block copy = new_block(err);
 	if (err != 0)
-		return 0;
+		return err;
 
-	uint64_t length = 0;
-	if (!m_log.write(static_cast<uint64_t>(LogRecord::Begin)) || !m_log.write(m_last_transaction+1) || !m_log.write(length))
-	{
-		err = m_log.last_error();
-		return 0;
-	}
+	char* data = static_cast<char*>(static_cast<void*>(copy));
+	memcpy(data,static_cast<const void*>(block),m_block_size);
 
-	m_write_inprogress = true;
+	Replayer replayer = { m_block_size, data, from.m_block_id, 0 };
+	size_t transactions = 0;
+	err = scan_journal(from.m_start_trans_id,to,replayer,transactions);
 
-	return m_last_transaction+1;
+	m_stats.add(Stats::JournalTransactionsReplayed,transactions);
+	m_stats.add(Stats::JournalRecordsReplayed,replayer.m_records);
+
+	if (err == 0)
+		block = copy;
+
+	return err;
 }
 
-int BlockStoreRW::commit_write_transaction(const id_t& trans_id)
+int BlockStoreBase::read_extent(const id_t& block_id, const id_t& trans_id, size_t offset, void* data, size_t length)
 {
-	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock);
+	if (trans_id > visible_transaction() || block_id == 0 || trans_id == 0)
+		return EINVAL;
 
-	if (!m_write_inprogress || trans_id != m_last_transaction+1)
-		return EACCES;
+	if (!length)
+		return 0;
 
-	int err = 0;
+	const id_t first = block_id + offset / m_block_size;
+	const id_t last = block_id + (offset + length - 1) / m_block_size;
 
-	// Write a commit record to the log
-	if (!m_log.write(static_cast<uint64_t>(LogRecord::Commit)))
-	{
-		err = m_log.last_error();
-	}
-	else
+	OOBase::Vector<id_t> changed;
+	int err = 0;
+	for (;;)
 	{
-		// Make sure we update the length marker before we start
-		m_log.replace(static_cast<uint64_t>(m_log.buffer()->length()-12),8);
+		id_t checkpoint_trans = 0;
+		id_t block_count = 0;
+		if ((err = begin_checkpoint_read(checkpoint_trans,block_count)) != 0)
+			return err;
 
-		OOBase::Guard<OOBase::SpinLock> journal_guard(m_journal_lock);
+		// Read the whole range from the store with one sequential read
+		size_t len = m_store_file.read_at(block_id * m_block_size + offset,data,length,err);
+		if (err == 0)
+			memset(static_cast<char*>(data) + len,0,length - len);
 
-		// Seek journal to end
-		if ((err = m_journal_file.seek_end(0)) != 0)
+		// Find the blocks that have changed in the journal since the last checkpoint
+		changed.clear();
+		for (id_t id = first; err == 0 && id <= last; ++id)
 		{
-			// Get journal position
-			uint64_t start_pos = 0;
-			if ((err = m_journal_file.tell(start_pos)) == 0)
-			{
-				// Write the log to the journal
-				if ((err = m_journal_file.write(m_log.buffer()->rd_ptr(),m_log.buffer()->length()) == 0))
-				{
-					// Sync the journal
-					if ((err = m_journal_file.sync()) == 0)
-					{
-						uint64_t journal_len = 0;
-						m_journal_file.length(journal_len);
-
-						// Check for checkpoint
-						if (trans_id % s_checkpoint_interval == 0 || journal_len > 0x40000000)
-							err = do_checkpoint();
+			if (in_journal(id,trans_id))
+				err = changed.push_back(id);
+		}
 
-						if (err == 0)
-							m_last_transaction = trans_id;
-					}
-				}
+		if (end_checkpoint_read(checkpoint_trans) || err != 0)
+			break;
+	}
 
-				if (err != 0)
-				{
-					// Reset journal file to start_pos
-					int err2 = m_journal_file.seek_begin(start_pos);
-					if (err2 == 0)
-						err2 = m_journal_file.truncate(start_pos);
+	// Now overlay them, outside the checkpoint lock as get_block() takes it too
+	for (size_t i = 0; err == 0 && i < changed.size(); ++i)
+	{
+		const id_t id = *changed.at(i);
 
-					if (err2 != 0)
-						err = err2;
-				}
-			}
-		}
-	}
+		Block block = get_block(id,trans_id,err);
+		if (err != 0)
+			return err;
 
-	m_log.reset();
+		// Copy the part of the block that falls within the range
+		size_t block_start = static_cast<size_t>(id - block_id) * m_block_size;
+		size_t from = (block_start < offset ? offset - block_start : 0);
+		size_t to = (block_start + m_block_size > offset + length ? offset + length - block_start : m_block_size);
 
-	m_write_inprogress = false;
-	m_write_condition.signal();
+		memcpy(static_cast<char*>(data) + (block_start + from - offset),static_cast<const char*>(static_cast<void*>(block)) + from,to - from);
+	}
 
-	return 0;
+	return err;
 }
 
-void BlockStoreRW::rollback_write_transaction(const id_t& trans_id)
+bool BlockStoreBase::in_journal(const id_t& block_id, const id_t& trans_id)
 {
-	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock);
+	OOBase::ReadGuard<OOBase::RWMutex> read_guard(m_lock);
 
-	if (m_write_inprogress && trans_id == m_last_transaction+1)
-	{
-		// Discard log contents
-		m_log.reset();
+	if (!m_journal_indexed)
+		return true;
 
-		m_write_inprogress = false;
-		m_write_condition.signal();
-	}
+	id_t* changed = m_journal_blocks.find(block_id);
+	return (changed && *changed <= trans_id);
 }
 
-int BlockStoreRW::checkpoint(const OOBase::Timeout& timeout)
+int BlockStoreBase::backup(const char* path, const id_t& since_trans_id, id_t& trans_id)
 {
-	// Acquire the lock with a timeout
-	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock,false);
-	if (!guard.acquire(timeout))
-		return ETIMEDOUT;
+	OOBase::LocalString dir_name;
+	OOBase::String file_name;
+	int err = OOBase::Paths::SplitDirAndFilename(path,dir_name,file_name);
 
-	while (m_write_inprogress)
-	{
-		if (!m_write_condition.wait(m_write_lock,timeout))
-			return ETIMEDOUT;
-	}
+	Directory dir;
+	if (err == 0)
+		err = dir.open(dir_name.c_str(),false);
 
-	m_write_inprogress = true;
+	File dest;
+	if (err == 0)
+		dest = dir.create_file(file_name.c_str(),true,err);
 
-	int err = do_checkpoint();
+	if (err == 0)
+		err = backup_i(dest,since_trans_id,trans_id);
 
-	m_write_inprogress = false;
-	m_write_condition.signal();
+	if (err == 0)
+		err = dest.sync();
 
 	return err;
 }
 
-int BlockStoreRW::update_block(const id_t& block_id, const id_t& trans_id, Block block)
+#if !defined(_WIN32)
+int BlockStoreBase::backup(int fd, const id_t& since_trans_id, id_t& trans_id)
 {
-	// This is not a 100% race-safe check, but it will help!
-	if (!m_write_inprogress || trans_id != m_last_transaction+1)
+	int err = 0;
+	File dest = File::dup_fd(fd,err);
+	if (err == 0)
+		err = backup_i(dest,since_trans_id,trans_id);
+
+	return err;
+}
+#endif
+
+int BlockStoreBase::backup_i(File& dest, const id_t& since_trans_id, id_t& trans_id)
+{
+	// Hold a read transaction so checkpoints can't move past our snapshot
+	int err = 0;
+	trans_id = begin_read_transaction(err);
+	if (err != 0)
+		return err;
+
+	// Everything up to first_transaction is already in the store file.  The
+	// checkpoint can't pass our snapshot, but it can move first_transaction and
+	// grow the store, so hold it still while we find what the journal holds.
+	// Once we have that, the checkpoint only writes blocks we take from the
+	// journal, so there is no need to hold it while copying.
+	OOBase::Set<id_t> changed;
+	OOBase::Set<id_t> since_changed;
+	OOBase::Set<id_t> freed;
+	id_t block_count = 0;
+	for (;;)
+	{
+		id_t first_transaction = 0;
+		id_t store_block_count = 0;
+		if ((err = begin_checkpoint_read(first_transaction,store_block_count)) != 0)
+			break;
+
+		if (since_trans_id != 0 && (since_trans_id < first_transaction || since_trans_id > trans_id))
+			err = ERANGE;
+
+		// Find every block with a newer version in the journal, and the end of the store as of trans_id
+		changed.clear();
+		BlockCollector collector = { &changed, store_block_count };
+		size_t transactions = 0;
+		if (err == 0)
+			err = scan_journal(first_transaction,trans_id,collector,transactions);
+
+		// An incremental only needs what happened after since_trans_id
+		since_changed.clear();
+		freed.clear();
+		if (err == 0 && since_trans_id != 0)
+		{
+			IncrementalCollector since_collector = { { &since_changed, 0 }, { &freed } };
+			err = scan_journal(since_trans_id,trans_id,since_collector,transactions);
+		}
+
+		block_count = collector.m_block_count;
+
+		if (end_checkpoint_read(first_transaction) || err != 0)
+			break;
+	}
+
+	if (err == 0)
+	{
+		if (!since_trans_id)
+			err = backup_full(dest,changed,trans_id,block_count);
+		else
+			err = backup_incremental(dest,since_changed,freed,since_trans_id,trans_id,block_count);
+	}
+
+	end_read_transaction(trans_id);
+
+	return err;
+}
+
+int BlockStoreBase::backup_full(File& dest, const OOBase::Set<id_t>& changed, const id_t& trans_id, const id_t& block_count)
+{
+	// The copy is a checkpointed store in its own right at trans_id
+	StoreHeader header = {0};
+	int err = 0;
+	size_t len = m_store_file.read_at(0,&header,sizeof(header),err);
+	if (err == 0 && len != sizeof(header))
+		err = EINVAL;
+
+	if (err == 0)
+	{
+		header.m_checkpoint_transaction = trans_id;
+		header.m_block_count = block_count;
+		header.m_generation = new_generation();
+
+		err = dest.write(&header,sizeof(header));
+	}
+
+	// Everything is written in order, so dest can be a pipe.
+	// Block 0 is only ever the header.
+	if (err == 0)
+		err = m_store_file.copy_to(dest,sizeof(header),m_block_size - sizeof(header));
+
+	// Copy the runs of blocks that the journal doesn't touch straight from the store,
+	// and the changed blocks as of trans_id
+	id_t next = 1;
+	for (size_t i = 0; err == 0 && next < block_count; ++i)
+	{
+		id_t stop = (i < changed.size() ? *changed.at(i) : block_count);
+		if (stop < next)
+			continue;
+
+		if (stop > block_count)
+			stop = block_count;
+
+		if (stop > next)
+			err = m_store_file.copy_to(dest,next * m_block_size,(stop - next) * m_block_size);
+
+		if (err == 0 && stop < block_count)
+		{
+			Block block = get_block(stop,trans_id,err);
+			if (err == 0)
+				err = dest.write(static_cast<void*>(block),m_block_size);
+		}
+
+		next = stop + 1;
+	}
+
+	return err;
+}
+
+int BlockStoreBase::backup_incremental(File& dest, const OOBase::Set<id_t>& changed, const OOBase::Set<id_t>& freed, const id_t& since_trans_id, const id_t& trans_id, const id_t& block_count)
+{
+	IncrementalHeader header = { s_incremental_magic, s_incremental_version, static_cast<uint32_t>(m_block_size), since_trans_id, trans_id, block_count };
+
+	int err = dest.write(&header,sizeof(header));
+
+	for (size_t i = 0; err == 0 && i < changed.size() && *changed.at(i) < block_count; ++i)
+	{
+		const id_t& block_id = *changed.at(i);
+
+		Block block = get_block(block_id,trans_id,err);
+		if (err == 0)
+		{
+			uint64_t record[2] = { LogRecord::Page, block_id };
+			File::IOBuffer buffers[2] = { { record, sizeof(record) }, { static_cast<void*>(block), m_block_size } };
+			err = dest.writev(buffers,2);
+		}
+	}
+
+	// Freed blocks let the restored store compact() as the original would
+	for (size_t i = 0; err == 0 && i < freed.size() && *freed.at(i) < block_count; ++i)
+	{
+		uint64_t record[2] = { LogRecord::Free, *freed.at(i) };
+		err = dest.write(record,sizeof(record));
+	}
+
+	if (err == 0)
+	{
+		uint64_t op = LogRecord::Commit;
+		err = dest.write(&op,sizeof(op));
+	}
+
+	return err;
+}
+
+BlockStoreRO::BlockStoreRO() : BlockStoreBase(),
+		m_index_trans(0),
+		m_index_end(0)
+{
+}
+
+int BlockStoreRO::open_i(const char* path, size_t block_size)
+{
+	int err = load(path,true,block_size);
+	if (err != 0 || !m_journal_file.is_open())
+		return err;
+
+	// Find the last committed transaction, in case there is no writer to tell us.
+	// Only the transaction headers are read, extend_index() reads the bodies once
+	// a reader needs them.  We always start from the top, as the writer may
+	// restart the journal.
+	uint64_t journal_len = 0;
+	if ((err = m_journal_file.length(journal_len)) != 0)
+		return err;
+
+	id_t last = m_first_transaction;
+	uint64_t last_end = 0;
+	bool last_compact = false;
+	for (uint64_t pos = m_journal_start;;)
+	{
+		uint64_t header[3];
+		size_t len = m_journal_file.read_at(pos,header,sizeof(header),err);
+		if (err != 0 || len < sizeof(header))
+			break;
+
+		// Anything incomplete, or out of sequence, is the tail of a commit that never finished
+		if (!is_begin(header[0]) || header[2] == 0 || header[2] > journal_len - pos - sizeof(header))
+			break;
+
+		pos += sizeof(header) + header[2];
+
+		// Skip anything already in the store, left behind by a checkpoint that didn't finish
+		if (header[1] <= m_first_transaction)
+			continue;
+
+		if (header[1] != last+1)
+			break;
+
+		last = header[1];
+		last_end = pos;
+		last_compact = (header[0] == LogRecord::BeginCompact);
+	}
+
+	// The writer appends each transaction whole, so only the last can be torn:
+	// keep it only if it ends with its Commit record
+	if (err == 0 && last_end)
+	{
+		uint64_t op = 0;
+		size_t op_len = (last_compact ? 1 : sizeof(op));
+		unsigned char tail[sizeof(op)];
+		if (m_journal_file.read_at(last_end - op_len,tail,op_len,err) == op_len && err == 0)
+		{
+			if (last_compact)
+				op = tail[0];
+			else
+				memcpy(&op,tail,sizeof(op));
+		}
+
+		if (err == 0 && op != LogRecord::Commit)
+			--last;
+	}
+
+	if (err == 0)
+	{
+		m_last_transaction = last;
+
+		// Only writers publish, so a region we created knows nothing yet
+		if (m_shared.is_open() && m_shared.created())
+			m_shared.catch_up(last);
+	}
+
+	return err;
+}
+
+int BlockStoreRO::begin_checkpoint_read(id_t& first, id_t& block_count)
+{
+	StoreHeader header = {0};
+	int err = 0;
+	size_t len = m_store_file.read_at(0,&header,sizeof(header),err);
+	if (err == 0 && len != sizeof(header))
+		err = EINVAL;
+
+	if (err == 0)
+	{
+		first = header.m_checkpoint_transaction;
+		block_count = header.m_block_count;
+	}
+	return err;
+}
+
+bool BlockStoreRO::end_checkpoint_read(const id_t& first)
+{
+	// The writer syncs the store before the header, and the header before
+	// restarting the journal, so an unchanged header means what we read is whole
+	id_t now = 0;
+	id_t block_count = 0;
+	return (begin_checkpoint_read(now,block_count) != 0 || now == first);
+}
+
+void BlockStoreRO::reset_index()
+{
+	m_journal_index.clear();
+	m_index_trans = 0;
+	m_index_end = m_journal_start;
+}
+
+int BlockStoreRO::extend_index(const id_t& to)
+{
+	// Caller must hold m_index_lock
+	int err = 0;
+	char* body = NULL;
+	size_t body_size = 0;
+
+	OOBase::Guard<OOBase::Mutex> journal_guard(m_journal_lock);
+
+	if (!m_index_trans)
+		m_index_end = m_journal_start;
+
+	while (m_index_trans < to)
+	{
+		uint64_t header[3];
+		size_t len = m_journal_file.read_at(m_index_end,header,sizeof(header),err);
+		if (err != 0 || len < sizeof(header))
+			break;
+
+		// A different transaction here means the writer has restarted the journal
+		if (!is_begin(header[0]) || (m_index_trans && header[1] != m_index_trans+1))
+		{
+			err = ESTALE;
+			break;
+		}
+
+		if (header[2] > body_size)
+		{
+			char* new_body = static_cast<char*>(OOBase::HeapAllocator::reallocate(body,static_cast<size_t>(header[2])));
+			if (!new_body)
+			{
+				err = ERROR_OUTOFMEMORY;
+				break;
+			}
+			body = new_body;
+			body_size = static_cast<size_t>(header[2]);
+		}
+
+		len = m_journal_file.read_at(m_index_end + sizeof(header),body,static_cast<size_t>(header[2]),err);
+		if (err == 0 && len != header[2])
+			err = EINVAL;
+
+		if (err == 0)
+		{
+			IndexCollector collector = { &m_journal_index, header[1], m_index_end, m_index_end + sizeof(header), body, m_index_end + sizeof(header) };
+			err = walk_transaction(m_block_size,header[0] == LogRecord::BeginCompact,body,len,collector);
+		}
+
+		if (err != 0)
+			break;
+
+		m_index_trans = header[1];
+		m_index_end += sizeof(header) + header[2];
+	}
+
+	journal_guard.release();
+
+	OOBase::HeapAllocator::free(body);
+
+	return err;
+}
+
+int BlockStoreRO::apply_journal(Block& block, const BlockSpan& from, const id_t& to)
+{
+	// Rather than scanning the whole journal for every block, index it once and
+	// then read only the records of the block we want.  The index lock is only
+	// held to extend the index and copy our entries out of it, not for the reads.
+	OOBase::Guard<OOBase::Mutex> guard(m_index_lock);
+
+	int err = 0;
+	if (to > m_index_trans)
+		err = extend_index(to);
+
+	if (err != 0)
+	{
+		// Start the index again next time, and scan the journal this time
+		reset_index();
+		guard.release();
+		return BlockStoreBase::apply_journal(block,from,to);
+	}
+
+	// Find the first entry for the block
+	OOBase::Vector<JournalEntry> entries;
+	size_t pos = m_journal_index.find_at(from.m_block_id);
+	for (;pos != m_journal_index.npos && pos > 0 && m_journal_index.key_at(pos-1)->m_block_id == from.m_block_id;--pos)
+		;
+
+	for (;err == 0 && pos != m_journal_index.npos && pos < m_journal_index.size(); ++pos)
+	{
+		const BlockSpan* span = m_journal_index.key_at(pos);
+		if (span->m_block_id != from.m_block_id || span->m_start_trans_id > to)
+			break;
+
+		if (span->m_start_trans_id > from.m_start_trans_id)
+		{
+			JournalEntry entry = { span->m_start_trans_id, *m_journal_index.at(pos) };
+			err = entries.push_back(entry);
+		}
+	}
+
+	guard.release();
+
+	if (err != 0)
+		return err;
+
+	// Cached blocks are shared, so play forward a private copy
+	Block copy = new_block(err);
+	if (err != 0)
+		return err;
+
+	char* data = static_cast<char*>(static_cast<void*>(copy));
+	memcpy(data,static_cast<const void*>(block),m_block_size);
+
+	Replayer replayer = { m_block_size, data, from.m_block_id, 0 };
+	size_t transactions = 0;
+	char* records = NULL;
+	size_t records_size = 0;
+
+	for (size_t i = 0; err == 0 && i < entries.size(); ++i)
+	{
+		const JournalEntry* entry = entries.at(i);
+		const JournalRef* ref = &entry->m_ref;
+
+		// Make sure the journal has not been restarted under us
+		uint64_t header[3];
+		size_t len = m_journal_file.read_at(ref->m_trans_offset,header,sizeof(header),err);
+		if (err == 0 && (len != sizeof(header) || !is_begin(header[0]) || header[1] != entry->m_trans_id))
+			err = ESTALE;
+
+		if (err == 0 && ref->m_length > records_size)
+		{
+			char* new_records = static_cast<char*>(OOBase::HeapAllocator::reallocate(records,static_cast<size_t>(ref->m_length)));
+			if (!new_records)
+				err = ERROR_OUTOFMEMORY;
+			else
+			{
+				records = new_records;
+				records_size = static_cast<size_t>(ref->m_length);
+			}
+		}
+
+		if (err == 0)
+		{
+			len = m_journal_file.read_at(ref->m_offset,records,static_cast<size_t>(ref->m_length),err);
+			if (err == 0 && len != ref->m_length)
+				err = EINVAL;
+		}
+
+		if (err == 0)
+			err = walk_transaction(m_block_size,header[0] == LogRecord::BeginCompact,records,len,replayer,false);
+
+		++transactions;
+	}
+
+	OOBase::HeapAllocator::free(records);
+
+	m_stats.add(Stats::JournalTransactionsReplayed,transactions);
+	m_stats.add(Stats::JournalRecordsReplayed,replayer.m_records);
+
+	if (err == ESTALE)
+	{
+		guard.acquire();
+		reset_index();
+		guard.release();
+		return BlockStoreBase::apply_journal(block,from,to);
+	}
+
+	if (err == 0)
+		block = copy;
+
+	return err;
+}
+
+bool BlockStoreRO::in_journal(const id_t& block_id, const id_t& trans_id)
+{
+	// Use the index we build for apply_journal() instead
+	OOBase::Guard<OOBase::Mutex> guard(m_index_lock);
+
+	if (trans_id > m_index_trans && extend_index(trans_id) != 0)
+	{
+		reset_index();
+		return true;
+	}
+
+	// Entries are ordered by transaction within each block, so check the first
+	size_t pos = m_journal_index.find_at(block_id);
+	if (pos == m_journal_index.npos)
+		return false;
+
+	for (;pos > 0 && m_journal_index.key_at(pos-1)->m_block_id == block_id;--pos)
+		;
+
+	return (m_journal_index.key_at(pos)->m_start_trans_id <= trans_id);
+}
+
+BlockStoreRW::BlockStoreRW() : BlockStoreBase(),
+		m_write_inprogress(false),
+		m_commit_sync(true),
+		m_log_length(NULL),
+		m_trans_block_count(0),
+		m_trans_alloc_first(0),
+		m_journal_reserved(0)
+{
+}
+
+BlockStoreRW::~BlockStoreRW()
+{
+	// Readers in other processes may hold the checkpoint back, and then the journal must stay
+	if (checkpoint() == 0 && m_first_transaction == m_last_transaction)
+	{
+		if (m_journal_file.is_open())
+		{
+			m_journal_file.unlock();
+			m_journal_file.close();
+		}
+
+		// Remove the journal file
+		OOBase::LocalString journal_name;
+		if (journal_name.concat(m_store_name.c_str(),".journal") == 0)
+			m_store_directory.remove_file(journal_name.c_str());
+	}
+}
+
+int BlockStoreRW::open_i(const char* path, size_t block_size)
+{
+	int err = load(path,false,block_size);
+	if (err != 0)
+		return err;
+
+	// Attempt to gain exclusive lock on journal file
+	err = m_journal_file.lock();
+	if (err != 0)
+		return err;
+
+	// We append BeginCompact transactions, so mark an older journal as ours first
+	JournalHeader journal_header = {0};
+	size_t len = m_journal_file.read_at(0,&journal_header,sizeof(journal_header),err);
+	if (err == 0 && len == sizeof(journal_header) && journal_header.m_version < s_journal_version)
+	{
+		journal_header.m_version = s_journal_version;
+		if ((err = m_journal_file.write_at(0,&journal_header,sizeof(journal_header))) == 0)
+			err = m_journal_file.sync();
+	}
+	if (err != 0)
+		return err;
+
+	// Pick up every transaction committed since the last checkpoint, and cut off
+	// any commit that was torn by a crash, so our commits follow on from the last good one
+	uint64_t start = 0;
+	uint64_t end = 0;
+	if ((err = recover_journal(start,end)) != 0)
+		return err;
+
+	uint64_t journal_len = 0;
+	if ((err = m_journal_file.length(journal_len)) != 0)
+		return err;
+
+	if (journal_len > end && (err = m_journal_file.truncate(end)) != 0)
+		return err;
+
+	m_journal_start = start;
+
+	// Find the blocks left free by the journal for compact()
+	FreeCollector collector = { &m_free_blocks };
+	size_t transactions = 0;
+	if (scan_journal(0,m_last_transaction,collector,transactions) != 0)
+		m_free_blocks.clear();
+
+	// We hold the journal lock, so our view of the store is the truth,
+	// and nothing cached by an earlier writer can be trusted
+	if (m_shared.is_open())
+	{
+		m_shared.reset_cache();
+		m_shared.publish(m_last_transaction);
+	}
+
+	// Do a checkpoint and ignore errors, the journal still has everything
+	do_checkpoint();
+
+	return 0;
+}
+
+OOKv::id_t BlockStoreRW::begin_write_transaction(int& err, const OOBase::Timeout& timeout)
+{
+	counter_t wait_start = Stats::now_ns();
+
+	// Acquire the lock with a timeout
+	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock,false);
+	if (!guard.acquire(timeout))
+	{
+		err = ETIMEDOUT;
+		return 0;
+	}
+
+	while (m_write_inprogress)
+	{
+		if (!m_write_condition.wait(m_write_lock,timeout))
+		{
+			err = ETIMEDOUT;
+			return 0;
+		}
+	}
+
+	m_stats.record(Stats::WriteLockWait,Stats::now_ns() - wait_start);
+
+	reset_log();
+
+	// The length marker is filled in at commit
+	if (!m_log.write(static_cast<uint64_t>(LogRecord::BeginCompact)) || !m_log.write(m_last_transaction+1) ||
+			(m_log_length = m_log.reserve(sizeof(uint64_t))) == NULL)
+	{
+		err = m_log.last_error();
+		return 0;
+	}
+
+	m_write_inprogress = true;
+
+	return m_last_transaction+1;
+}
+
+int BlockStoreRW::commit_write_transaction(const id_t& trans_id)
+{
+	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock);
+
+	if (!m_write_inprogress || trans_id != m_last_transaction+1)
+		return EACCES;
+
+	int err = 0;
+
+	// Write a commit record to the log
+	if (!m_log.write(static_cast<unsigned char>(LogRecord::Commit)))
+	{
+		err = m_log.last_error();
+	}
+	else
+	{
+		// Make sure we update the length marker before we start, it counts the bytes following it
+		uint64_t length = m_log.length() - 3 * sizeof(uint64_t);
+		memcpy(m_log_length,&length,sizeof(length));
+
+		// Write the log to the journal straight from its chunks
+		err = append_transaction(m_log.buffers(),m_log.buffer_count(),trans_id,m_trans_block_count,m_log_block_ids);
+		if (err == 0)
+		{
+			m_stats.add(Stats::Commits);
+			m_stats.add(Stats::CommitBytes,m_log.length());
+
+			update_free_blocks();
+
+			// Only now are the new versions real
+			for (size_t i = 0; i < m_log_versions.size(); ++i)
+			{
+				const Block* block = m_log_versions.at(i);
+				if (*block)
+					cache_insert(BlockSpan(*m_log_versions.key_at(i),trans_id),*block);
+			}
+		}
+	}
+
+	reset_log();
+
+	m_write_inprogress = false;
+	m_write_condition.signal();
+
+	return err;
+}
+
+int BlockStoreRW::append_transaction(const File::IOBuffer* buffers, size_t count, const id_t& trans_id, const id_t& block_count, const OOBase::Vector<id_t>& block_ids)
+{
+	// Caller must hold m_write_lock
+	OOBase::Guard<OOBase::Mutex> journal_guard(m_journal_lock);
+
+	// Seek journal to end
+	uint64_t journal_len = 0;
+	int err = m_journal_file.seek_end(0);
+	if (err == 0)
+	{
+		// Get journal position
+		uint64_t start_pos = 0;
+		if ((err = m_journal_file.tell(start_pos)) == 0)
+		{
+			// Keep disk space reserved past the end, so appends do not allocate.
+			// Without support appends just allocate as they go, so errors are ignored.
+			uint64_t end_pos = start_pos;
+			for (size_t i = 0; i < count; ++i)
+				end_pos += buffers[i].m_length;
+
+			if (end_pos > m_journal_reserved)
+			{
+				uint64_t reserve = (end_pos / 8 > s_journal_reserve ? end_pos / 8 : s_journal_reserve);
+				m_journal_file.allocate(start_pos,end_pos + reserve - start_pos,true);
+				m_journal_reserved = end_pos + reserve;
+			}
+
+			counter_t phase_start = Stats::now_ns();
+			if ((err = m_journal_file.writev(buffers,count)) == 0)
+			{
+				counter_t phase_end = Stats::now_ns();
+				m_stats.record(Stats::CommitWrite,phase_end - phase_start);
+				phase_start = phase_end;
+
+				// Sync the journal, the blocks are already allocated so only the length is metadata
+				if (!m_commit_sync || (err = m_journal_file.data_sync()) == 0)
+				{
+					m_stats.record(Stats::CommitSync,Stats::now_ns() - phase_start);
+
+					journal_len = end_pos;
+
+					m_last_transaction = trans_id;
+					m_block_count = block_count;
+
+					// Remember which blocks now have versions in the journal
+					OOBase::Guard<OOBase::RWMutex> cache_guard(m_lock);
+					for (size_t i = 0; i < block_ids.size(); ++i)
+					{
+						if (!m_journal_blocks.exists(*block_ids.at(i)) && m_journal_blocks.insert(*block_ids.at(i),trans_id) != 0)
+							m_journal_indexed = false;
+					}
+					cache_guard.release();
+
+					// Let other processes see the new transaction
+					if (m_shared.is_open())
+						m_shared.publish(trans_id);
+				}
+			}
+
+			if (err != 0)
+			{
+				// Reset journal file to start_pos
+				int err2 = m_journal_file.seek_begin(start_pos);
+				if (err2 == 0)
+					err2 = m_journal_file.truncate(start_pos);
+
+				if (err2 != 0)
+					err = err2;
+
+				// Truncation releases the reserved space too
+				m_journal_reserved = start_pos;
+			}
+		}
+	}
+
+	journal_guard.release();
+
+	// The checkpoint replays the journal, so it runs outside the journal lock.
+	// The transaction is already safe in the journal, so a failed checkpoint is not a failed commit.
+	if (err == 0 && (trans_id % s_checkpoint_interval == 0 || journal_len > 0x40000000))
+	{
+		counter_t phase_start = Stats::now_ns();
+		do_checkpoint();
+		m_stats.record(Stats::CommitCheckpoint,Stats::now_ns() - phase_start);
+	}
+
+	return err;
+}
+
+void BlockStoreRW::reset_log()
+{
+	m_log.reset();
+	m_log_blocks.clear();
+	m_log_block_ids.clear();
+	m_log_free_ids.clear();
+	m_log_versions.clear();
+	m_trans_block_count = m_block_count;
+	m_trans_alloc_first = m_block_count;
+}
+
+int BlockStoreRW::set_version(const id_t& block_id, const Block& block)
+{
+	Block* version = m_log_versions.find(block_id);
+	if (!version)
+		return m_log_versions.insert(block_id,block);
+
+	*version = block;
+	return 0;
+}
+
+void BlockStoreRW::update_free_blocks()
+{
+	// Written blocks are live, even if they were free before.
+	// Failing to record a free block only costs compact() a slot.
+	for (size_t i = 0; i < m_log_block_ids.size(); ++i)
+		m_free_blocks.remove(*m_log_block_ids.at(i));
+
+	for (size_t i = 0; i < m_log_free_ids.size(); ++i)
+	{
+		if (*m_log_free_ids.at(i) < m_block_count)
+			m_free_blocks.insert(*m_log_free_ids.at(i));
+	}
+
+	while (!m_free_blocks.empty() && *m_free_blocks.at(m_free_blocks.size()-1) >= m_block_count)
+		m_free_blocks.remove_at(m_free_blocks.size()-1);
+}
+
+void BlockStoreRW::rollback_write_transaction(const id_t& trans_id)
+{
+	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock);
+
+	if (m_write_inprogress && trans_id == m_last_transaction+1)
+	{
+		// Discard log contents
+		reset_log();
+
+		m_write_inprogress = false;
+		m_write_condition.signal();
+	}
+}
+
+int BlockStoreRW::checkpoint(const OOBase::Timeout& timeout)
+{
+	counter_t wait_start = Stats::now_ns();
+
+	// Acquire the lock with a timeout
+	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock,false);
+	if (!guard.acquire(timeout))
+		return ETIMEDOUT;
+
+	while (m_write_inprogress)
+	{
+		if (!m_write_condition.wait(m_write_lock,timeout))
+			return ETIMEDOUT;
+	}
+
+	m_stats.record(Stats::WriteLockWait,Stats::now_ns() - wait_start);
+
+	m_write_inprogress = true;
+
+	int err = do_checkpoint();
+
+	m_write_inprogress = false;
+	m_write_condition.signal();
+
+	return err;
+}
+
+void BlockStoreRW::set_commit_sync(bool sync)
+{
+	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock);
+
+	m_commit_sync = sync;
+}
+
+int BlockStoreRW::update_block(const id_t& block_id, const id_t& trans_id, Block block)
+{
+	// This is not a 100% race-safe check, but it will help!
+	if (!m_write_inprogress || trans_id != m_last_transaction+1)
+		return EACCES;
+
+	if (block_id == 0)
+		return EINVAL;
+
+	// Diff against our own latest version, if we have written the block already.
+	// Blocks allocated by this transaction start out zeroed by their Alloc record.
+	int err = 0;
+	Block prev_block;
+	Block* version = m_log_versions.find(block_id);
+	if (version && *version)
+		prev_block = *version;
+	else if (block_id < m_block_count)
+		prev_block = get_block(block_id,trans_id-1,err);
+	else if ((prev_block = new_block(err)))
+		memset(static_cast<void*>(prev_block),0,m_block_size);
+
+	if (err != 0)
+		return err;
+
+	// Keep block alive until commit, as the log references its data
+	if ((err = m_log_blocks.push_back(block)) != 0)
+		return err;
+
+	// Write a diff block to the log
+	if (!write_record(m_log,LogRecord::Diff,block_id))
+	{
+		return m_log.last_error();
+	}
+
+	if ((err = m_log_block_ids.push_back(block_id)) != 0)
+		return err;
+
+	const char* prev_data = static_cast<const char*>(static_cast<const void*>(prev_block));
+	const char* data = static_cast<const char*>(static_cast<const void*>(block));
+
+	// Write the diff of old_block -> block to the log
+	if (!Diff::write_compact(m_block_size,m_log,prev_data,data))
+		return m_log.last_error();
+
+	// Watch out for very big transactions!
+	if (log_full(m_log,0))
+		return E2BIG;
+
+	// The cache gets it at commit
+	return set_version(block_id,block);
+}
+
+int BlockStoreRW::free_block(const id_t& block_id, const id_t& trans_id)
+{
+	// This is not a 100% race-safe check, but it will help!
+	if (!m_write_inprogress || trans_id != m_last_transaction+1)
+		return EACCES;
+
+	if (block_id == 0)
+		return EINVAL;
+
+	// Watch out for very big transactions!
+	if (log_full(m_log,1))
+		return E2BIG;
+
+	// Write a free block record to the log
+	if (!write_record(m_log,LogRecord::Free,block_id))
+	{
+		return m_log.last_error();
+	}
+
+	int err = m_log_free_ids.push_back(block_id);
+	if (err == 0)
+		err = set_version(block_id,Block());
+
+	return err;
+}
+
+int BlockStoreRW::compact(const id_t& trans_id, RelocateCallback callback, void* param)
+{
+	// This is not a 100% race-safe check, but it will help!
+	if (!m_write_inprogress || trans_id != m_last_transaction+1)
 		return EACCES;
 
-	if (block_id == 0)
-		return EINVAL;
+	if (!callback)
+		return EINVAL;
+
+	// The caller holds the ids of blocks allocated by this transaction, and may still
+	// write them as extents, so they can't move
+	if (m_trans_alloc_first < m_trans_block_count)
+		return EBUSY;
+
+	// Only blocks free as of the last commit are candidates, unless this transaction
+	// has written them since.  Blocks this transaction has freed need no moving.
+	id_t block_count = m_trans_block_count;
+	size_t first = 0;
+	size_t last = m_free_blocks.size();
+	int err = 0;
+	while (err == 0)
+	{
+		// Free blocks at the end need no moving
+		for (;;)
+		{
+			Block* version = m_log_versions.find(block_count-1);
+			if (version && !*version)
+				--block_count;
+			else if (last > first && *m_free_blocks.at(last-1) == block_count-1)
+			{
+				--last;
+				--block_count;
+			}
+			else
+				break;
+		}
+
+		// Skip slots we have reused
+		Block* to_version = NULL;
+		while (first < last && (to_version = m_log_versions.find(*m_free_blocks.at(first))) != NULL && *to_version)
+			++first;
+
+		if (first == last)
+			break;
+
+		// Watch out for very big transactions!
+		if (log_full(m_log,2,m_block_size))
+			return E2BIG;
+
+		id_t to_block_id = *m_free_blocks.at(first++);
+		id_t from_block_id = block_count - 1;
+
+		// Move what this transaction has written, if anything
+		Block block;
+		Block* version = m_log_versions.find(from_block_id);
+		if (version)
+			block = *version;
+		else
+			block = get_block(from_block_id,trans_id-1,err);
+		if (err != 0)
+			break;
+
+		// Keep block alive until commit, as the log references its data
+		if ((err = m_log_blocks.push_back(block)) != 0)
+			break;
+
+		// Log the whole page at its new home, and free the old one
+		if (!write_record(m_log,LogRecord::Page,to_block_id) ||
+				!m_log.write_ref(static_cast<const void*>(block),m_block_size) ||
+				!write_record(m_log,LogRecord::Free,from_block_id))
+		{
+			return m_log.last_error();
+		}
+
+		if ((err = m_log_block_ids.push_back(to_block_id)) == 0 &&
+				(err = m_log_free_ids.push_back(from_block_id)) == 0 &&
+				(err = set_version(to_block_id,block)) == 0 &&
+				(err = set_version(from_block_id,Block())) == 0)
+		{
+			err = (*callback)(param,trans_id,from_block_id,to_block_id);
+		}
+
+		--block_count;
+	}
+
+	if (err == 0 && block_count < m_trans_block_count)
+	{
+		// Record the new end of the store
+		if (!write_record(m_log,LogRecord::Truncate,block_count))
+		{
+			return m_log.last_error();
+		}
+
+		m_trans_block_count = block_count;
+	}
+
+	return err;
+}
+
+int BlockStoreRW::restore(const char* path)
+{
+	OOBase::LocalString dir_name;
+	OOBase::String file_name;
+	int err = OOBase::Paths::SplitDirAndFilename(path,dir_name,file_name);
+
+	Directory dir;
+	if (err == 0)
+		err = dir.open(dir_name.c_str(),true);
+
+	File src;
+	if (err == 0)
+		src = dir.open_file(file_name.c_str(),true,err);
+
+	IncrementalHeader header = {0};
+	if (err == 0 && src.read_at(0,&header,sizeof(header),err) != sizeof(header) && err == 0)
+		err = EINVAL;
+
+	if (err == 0 && (header.m_magic != s_incremental_magic ||
+			header.m_version != s_incremental_version ||
+			header.m_block_size != m_block_size ||
+			header.m_block_count == 0 ||
+			header.m_to_transaction < header.m_from_transaction))
+	{
+		err = EINVAL;
+	}
+
+	if (err != 0)
+		return err;
+
+	// Exclude writers and checkpoints, like a write transaction
+	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock);
+	while (m_write_inprogress)
+		m_write_condition.wait(m_write_lock);
 
-	int err = 0;
-	Block prev_block = get_block(block_id,trans_id-1,err);
+	m_write_inprogress = true;
+
+	err = restore_i(src,header);
+
+	m_write_inprogress = false;
+	m_write_condition.signal();
+
+	return err;
+}
+
+int BlockStoreRW::restore_i(File& src, const IncrementalHeader& header)
+{
+	// Caller must hold m_write_lock.
+	// The blocks go straight over the store, so the journal must be empty,
+	// and no reader may be looking at the store
+	int err = do_checkpoint();
 	if (err != 0)
 		return err;
 
-	// Write a diff block to the log
-	if (!m_log.write(static_cast<uint64_t>(LogRecord::Diff)) ||
-			!m_log.write(block_id))
-	{
-		return m_log.last_error();
-	}
+	if (m_first_transaction != m_last_transaction || m_last_transaction != header.m_from_transaction)
+		return ERANGE;
 
-	const char* prev_data = static_cast<const char*>(static_cast<const void*>(prev_block));
-	const char* data = static_cast<const char*>(static_cast<const void*>(block));
+	id_t after_last = m_last_transaction + 1;
+	if (m_read_transactions.oldest(after_last) != after_last)
+		return EBUSY;
 
-	// Write the diff of old_block -> block to the log
-	for (size_t pos = 0; pos < s_block_size;)
-	{
-		uint16_t marker;
+	// Check the whole backup is there before touching the store
+	OOBase::Vector<id_t> pages;
+	OOBase::Vector<id_t> freed;
+	if ((err = restore_records(src,header,false,pages,freed)) != 0)
+		return err;
 
-		for (marker = 0;prev_data[pos] == data[pos] && pos < s_block_size;++pos)
-			++marker;
+	// Readers in this process wait until the store is whole again
+	OOBase::Guard<OOBase::RWMutex> checkpoint_guard(m_checkpoint_lock);
 
-		if (marker != 0 && !m_log.write(marker))
-			return m_log.last_error();
+	uint64_t store_len = 0;
+	err = m_store_file.length(store_len);
+
+	uint64_t store_end = header.m_block_count * m_block_size;
+	bool grown = (err == 0 && store_end > store_len);
+	if (grown)
+		err = m_store_file.truncate(store_end);
+
+	if (err == 0)
+		err = restore_records(src,header,true,pages,freed);
+
+	// The blocks must be on disk before the header says they are
+	if (err == 0)
+		err = (grown ? m_store_file.sync() : m_store_file.data_sync());
 
-		for (marker = 0;prev_data[pos] != data[pos] && pos < s_block_size;++pos)
-			++marker;
+	if (err == 0)
+	{
+		StoreHeader store_header = {0};
+		size_t len = m_store_file.read_at(0,&store_header,sizeof(store_header),err);
+		if (err == 0 && len != sizeof(store_header))
+			err = EINVAL;
 
-		if (marker != 0)
+		if (err == 0)
 		{
-			// Write the changed bytes
-			if (!m_log.write(marker | 0x8000) || !m_log.write(data + (pos-marker),marker))
-				return m_log.last_error();
+			store_header.m_checkpoint_transaction = header.m_to_transaction;
+			store_header.m_block_count = header.m_block_count;
+
+			if ((err = m_store_file.write_at(0,&store_header,sizeof(store_header))) == 0)
+				err = m_store_file.data_sync();
 		}
 	}
 
-	// Watch out for very big transactions!
-	if (m_log.buffer()->length() > (0x8000000000000000ull - 12))
-		return E2BIG;
+	if (err != 0)
+		return err;
 
-	if (err == 0)
+	if (store_len > store_end)
+		m_store_file.truncate(store_end);
+
+	m_first_transaction = header.m_to_transaction;
+	m_last_transaction = header.m_to_transaction;
+	m_block_count = header.m_block_count;
+	m_store_block_count = header.m_block_count;
+
+	// The empty journal now follows on from the restored store
+	OOBase::Guard<OOBase::Mutex> journal_guard(m_journal_lock);
+	err = write_journal_header();
+	journal_guard.release();
+
+	// Every cached version was built from the old store
+	for (size_t i = 0; i < m_topology.node_count(); ++i)
+	{
+		OOBase::Guard<OOBase::RWMutex> cache_guard(m_cache[i]->m_lock);
+		m_cache[i]->m_cache.clear();
+	}
+
+	if (m_shared.is_open())
 	{
-		// Update cache
-		OOBase::Guard<OOBase::RWMutex> guard(m_lock);
-		m_cache.insert(BlockSpan(block_id,trans_id),block);
+		m_shared.reset_cache();
+		m_shared.publish(m_last_transaction);
 	}
 
+	// Restored blocks are live, and failing to record a free block only costs compact() a slot
+	for (size_t i = 0; i < pages.size(); ++i)
+		m_free_blocks.remove(*pages.at(i));
+
+	for (size_t i = 0; i < freed.size(); ++i)
+		m_free_blocks.insert(*freed.at(i));
+
+	while (!m_free_blocks.empty() && *m_free_blocks.at(m_free_blocks.size()-1) >= m_block_count)
+		m_free_blocks.remove_at(m_free_blocks.size()-1);
+
 	return err;
 }
 
-int BlockStoreRW::free_block(const id_t& block_id, const id_t& trans_id)
+int BlockStoreRW::restore_records(File& src, const IncrementalHeader& header, bool apply, OOBase::Vector<id_t>& pages, OOBase::Vector<id_t>& freed)
 {
-	// This is not a 100% race-safe check, but it will help!
-	if (!m_write_inprogress || trans_id != m_last_transaction+1)
-		return EACCES;
+	Block block;
+	int err = 0;
+	if (apply)
+		block = new_block(err);
 
-	if (block_id == 0)
-		return EINVAL;
+	uint64_t pos = sizeof(header);
+	while (err == 0)
+	{
+		uint64_t op = 0;
+		if (src.read_at(pos,&op,sizeof(op),err) != sizeof(op))
+			return (err ? err : EINVAL);
 
-	// Watch out for very big transactions!
-	if (m_log.buffer()->length() > (0x8000000000000000ull - 12 - 8))
-		return E2BIG;
+		pos += sizeof(op);
+		if (op == LogRecord::Commit)
+			break;
 
-	// Write a free block record to the log
-	if (!m_log.write(static_cast<uint64_t>(LogRecord::Free)) ||
-			!m_log.write(block_id))
-	{
-		return m_log.last_error();
+		id_t block_id = 0;
+		if (src.read_at(pos,&block_id,sizeof(block_id),err) != sizeof(block_id))
+			return (err ? err : EINVAL);
+
+		pos += sizeof(block_id);
+		if (block_id == 0 || block_id >= header.m_block_count)
+			return EINVAL;
+
+		if (op == LogRecord::Free)
+		{
+			if (!apply)
+				err = freed.push_back(block_id);
+		}
+		else if (op != LogRecord::Page)
+			err = EINVAL;
+		else if (!apply)
+		{
+			// Just check the page is all there
+			uint64_t len = 0;
+			if ((err = src.length(len)) == 0)
+				err = (len - pos < m_block_size ? EINVAL : pages.push_back(block_id));
+
+			pos += m_block_size;
+		}
+		else
+		{
+			if (src.read_at(pos,static_cast<void*>(block),m_block_size,err) != m_block_size)
+				return (err ? err : EINVAL);
+
+			err = m_store_file.write_at(block_id * m_block_size,static_cast<void*>(block),m_block_size);
+			pos += m_block_size;
+		}
 	}
 
-	return 0;
+	return err;
 }
 
 OOKv::id_t BlockStoreRW::alloc_block(const id_t& trans_id, Block& block, int& err)
@@ -661,171 +2578,435 @@ OOKv::id_t BlockStoreRW::alloc_block(const id_t& trans_id, Block& block, int& er
 	}
 
 	// Watch out for very big transactions!
-	if (m_log.buffer()->length() > (0x8000000000000000ull - 12 - 8))
+	if (log_full(m_log,1))
 	{
 		err = E2BIG;
 		return 0;
 	}
 
-	// Allocate new block from somewhere
-	void* TODO;
+	// New blocks start out zeroed, just as their Alloc record replays them.
+	// The caller gets a copy of its own to fill in and pass to update_block()
+	Block zeroed = new_block(err);
+	Block copy;
+	if (err == 0)
+		copy = new_block(err);
+	if (err != 0)
+		return 0;
+
+	memset(static_cast<void*>(zeroed),0,m_block_size);
+	memset(static_cast<void*>(copy),0,m_block_size);
 
-	id_t block_id = 1;
+	// New blocks come from the end of the store
+	id_t block_id = m_trans_block_count;
 
 	// Write an alloc record to the log
-	if (!m_log.write(static_cast<uint64_t>(LogRecord::Alloc)) ||
-			!m_log.write(block_id))
+	if (!write_record(m_log,LogRecord::Alloc,block_id))
 	{
 		err = m_log.last_error();
 		return 0;
 	}
 
-	if (err == 0)
+	++m_trans_block_count;
+	if (block_id < m_trans_alloc_first)
+		m_trans_alloc_first = block_id;
+
+	// The cache gets it at commit
+	if ((err = set_version(block_id,zeroed)) != 0)
+		return 0;
+
+	block = copy;
+	return block_id;
+}
+
+OOKv::id_t BlockStoreRW::alloc_extent(const id_t& trans_id, size_t block_count, int& err)
+{
+	// This is not a 100% race-safe check, but it will help!
+	if (!m_write_inprogress || trans_id != m_last_transaction+1)
+	{
+		err = EACCES;
+		return 0;
+	}
+
+	if (block_count == 0)
 	{
-		// Update cache
-		OOBase::Guard<OOBase::RWMutex> guard(m_lock);
-		m_cache.insert(BlockSpan(block_id,trans_id),block);
+		err = EINVAL;
+		return 0;
+	}
+
+	// Watch out for very big transactions!
+	if (log_full(m_log,block_count))
+	{
+		err = E2BIG;
+		return 0;
 	}
 
+	// Extents are always carved from the end of the store, so they are contiguous
+	id_t block_id = m_trans_block_count;
+
+	for (size_t i = 0; i < block_count; ++i)
+	{
+		// Write an alloc record to the log
+		if (!write_record(m_log,LogRecord::Alloc,block_id + i))
+		{
+			err = m_log.last_error();
+			return 0;
+		}
+	}
+
+	m_trans_block_count += block_count;
+	if (block_id < m_trans_alloc_first)
+		m_trans_alloc_first = block_id;
+
+	err = 0;
 	return block_id;
 }
 
-int BlockStoreRW::do_checkpoint()
+int BlockStoreRW::write_extent(const id_t& block_id, const id_t& trans_id, size_t offset, const void* data, size_t length)
 {
-	id_t earliest_read_transaction = m_first_transaction;
-
-	// Create checkpoint file
-	OOBase::LocalString checkpoint_name;
-	int err = checkpoint_name.concat(m_store_name.c_str(),".checkpoint");
-	if (err != 0)
-		return err;
+	// This is not a 100% race-safe check, but it will help!
+	if (!m_write_inprogress || trans_id != m_last_transaction+1)
+		return EACCES;
 
-	File checkpoint_file = m_store_directory.create_file(checkpoint_name.c_str(),true,err);
-	if (err != 0)
-		return err;
+	// Whole pages may only be written to blocks allocated by this transaction
+	if (block_id == 0 || offset % m_block_size != 0 ||
+			block_id + offset / m_block_size < m_trans_alloc_first ||
+			block_id + (offset + length + m_block_size - 1) / m_block_size > m_trans_block_count)
+	{
+		return EINVAL;
+	}
 
-	// Acquire the journal lock
-	OOBase::Guard<OOBase::SpinLock> journal_guard(m_journal_lock);
+	// Watch out for very big transactions!
+	uint64_t pages = (length + m_block_size - 1) / m_block_size;
+	if (log_full(m_log,pages,pages * m_block_size))
+		return E2BIG;
 
-	// Play forward journal to earliest_read_transaction
-	if ((err = m_journal_file.seek_begin(m_journal_start)) != 0)
+	const char* src = static_cast<const char*>(data);
+	for (id_t id = block_id + offset / m_block_size; length; ++id)
 	{
-		while (err == 0)
+		size_t len = (length < m_block_size ? length : m_block_size);
+
+		// Keep the page as our version of the block, so a later update_block() diffs against it
+		int err = 0;
+		Block page = new_block(err);
+		if (err != 0)
+			return err;
+
+		memcpy(static_cast<void*>(page),src,len);
+		if (len < m_block_size)
+			memset(static_cast<char*>(static_cast<void*>(page)) + len,0,m_block_size - len);
+
+		if ((err = m_log_blocks.push_back(page)) != 0)
+			return err;
+
+		// New pages have no previous version worth diffing against, so log the whole page
+		if (!write_record(m_log,LogRecord::Page,id) ||
+				!m_log.write_ref(static_cast<const void*>(page),m_block_size))
 		{
-			uint64_t op = 0;
-			if (m_journal_file.read(op,err))
-			{
-				if (op != LogRecord::Commit)
-					err = EINVAL;
-				else
-				{
-					id_t trans_id = 0;
-					uint64_t next_commit = 0;
-					if (!m_journal_file.read(trans_id,err) || !m_journal_file.read(next_commit,err))
-					{
-						// We must have an id and a next commit!
-						if (err == 0)
-							err = EINVAL;
-					}
-					else
-					{
-						// Get the earliest transaction
-						OOBase::ReadGuard<OOBase::RWMutex> read_guard(m_lock);
-
-						id_t earliest_read_transaction = m_last_transaction;
-						if (!m_read_transactions.empty())
-							earliest_read_transaction = *m_read_transactions.at(0);
-
-						read_guard.release();
-
-						// If we have reached the start of an in-progress read transaction, stop
-						if (trans_id >= earliest_read_transaction)
-							break;
-
-						// If we are reading an old journal, skip onwards
-						if (trans_id < m_first_transaction)
-							err = m_journal_file.seek_cur(static_cast<int64_t>(next_commit));
-						else
-						{
-							// Apply each record...
-							void* TODO;
-						}
-					}
-				}
-			}
+			return m_log.last_error();
 		}
 
-		if (err == 0)
+		if ((err = m_log_block_ids.push_back(id)) != 0 ||
+				(err = set_version(id,page)) != 0)
 		{
-			// Now write the 0 block changes...
+			return err;
+		}
 
-			// Now write some kind of checksum or hash!
+		src += len;
+		length -= len;
+	}
 
-			// Sync checkpoint file
-			if ((err = checkpoint_file.sync()) == 0)
-			{
-				// Play forward checkpoint file, writing each block to store file
-				err = apply_checkpoint(checkpoint_file,false);
-			}
-		}
+	return 0;
+}
+
+int BlockStoreRW::do_checkpoint()
+{
+	// Caller must hold m_write_lock, or be opening the store
+	counter_t start = Stats::now_ns();
+
+	// Every reader must still be able to build its snapshot, so go no further than the oldest
+	id_t to = m_read_transactions.oldest(m_last_transaction);
+	if (to <= m_first_transaction)
+		return 0;
+
+	// Find every block with a newer version in the journal, and the end of the store as of to
+	OOBase::Set<id_t> changed;
+	BlockCollector collector = { &changed, m_store_block_count };
+	size_t transactions = 0;
+	uint64_t next_pos = 0;
+	int err = scan_journal(m_first_transaction,to,collector,transactions,&next_pos);
+
+	// Grow the store file once up front, rather than a block at a time.
+	// Without support for allocation, just extend it
+	uint64_t store_len = 0;
+	if (err == 0)
+		err = m_store_file.length(store_len);
+
+	uint64_t store_end = collector.m_block_count * m_block_size;
+	bool grown = (err == 0 && store_end > store_len);
+	if (grown && (err = m_store_file.allocate(store_len,store_end - store_len,false)) == ENOTSUP)
+		err = m_store_file.truncate(store_end);
+
+	// Write each block as of to over its old version.  Readers may see a mix of
+	// the two, but they replay the journal from m_first_transaction over it, and
+	// every record replaces bytes, so they still get the right answer.
+	// A crash part way through is repaired the same way at the next open.
+	uint64_t bytes = 0;
+	for (size_t i = 0; err == 0 && i < changed.size(); ++i)
+	{
+		const id_t& block_id = *changed.at(i);
+		if (block_id >= collector.m_block_count)
+			break;
+
+		Block block = get_block(block_id,to,err);
+		if (err == 0)
+			err = m_store_file.write_at(block_id * m_block_size,static_cast<void*>(block),m_block_size);
+
+		bytes += m_block_size;
 	}
 
-	// Delete checkpoint file
-	checkpoint_file.close();
-	m_store_directory.remove_file(checkpoint_name.c_str());
+	// The blocks must be on disk before the header says they are.
+	// If the length did not change, only the data needs syncing
+	if (err == 0)
+		err = (grown ? m_store_file.sync() : m_store_file.data_sync());
+
+	if (err == 0)
+	{
+		StoreHeader header = {0};
+		size_t len = m_store_file.read_at(0,&header,sizeof(header),err);
+		if (err == 0 && len != sizeof(header))
+			err = EINVAL;
+
+		if (err == 0)
+		{
+			header.m_checkpoint_transaction = to;
+			header.m_block_count = collector.m_block_count;
+
+			if ((err = m_store_file.write_at(0,&header,sizeof(header))) == 0)
+				err = m_store_file.data_sync();
+		}
+	}
 
 	if (err == 0)
 	{
-		m_first_transaction = earliest_read_transaction;
+		// Wait for readers part way through the old checkpoint
+		OOBase::Guard<OOBase::RWMutex> checkpoint_guard(m_checkpoint_lock);
 
-		// See if we can truncate the file, and reset m_journal_start
-		if (m_first_transaction == m_last_transaction && m_journal_file.truncate(0) == 0)
-			m_journal_start = 0;
+		m_first_transaction = to;
+		m_store_block_count = collector.m_block_count;
+
+		// Shrink the store file once compacted blocks are out of every reader's view
+		if (store_len > store_end)
+			m_store_file.truncate(store_end);
+
+		OOBase::Guard<OOBase::Mutex> journal_guard(m_journal_lock);
+
+		// Restart the journal if the store now has everything, keeping its header,
+		// else just skip what the store now has
+		if (to == m_last_transaction && m_journal_file.truncate(sizeof(JournalHeader)) == 0)
+		{
+			write_journal_header();
+
+			m_journal_start = sizeof(JournalHeader);
+			m_journal_reserved = 0;
+
+			// Every block is now up to date in the store
+			OOBase::Guard<OOBase::RWMutex> guard(m_lock);
+			m_journal_blocks.clear();
+			m_journal_indexed = true;
+		}
 		else
-			m_journal_file.tell(m_journal_start);
+			m_journal_start = next_pos;
+
+		journal_guard.release();
+		checkpoint_guard.release();
+
+		m_stats.add(Stats::Checkpoints);
+		m_stats.add(Stats::CheckpointBytes,bytes);
 	}
 
+	m_stats.record(Stats::Checkpoint,Stats::now_ns() - start);
+
 	return err;
 }
 
-int BlockStoreRW::apply_checkpoint(File& checkpoint_file, bool validate)
+BlockStoreReplica::BlockStoreReplica() : BlockStoreRW(),
+		m_source_seekable(true),
+		m_source_start(0),
+		m_pending(NULL),
+		m_pending_len(0),
+		m_pending_size(0)
+{
+}
+
+BlockStoreReplica::~BlockStoreReplica()
+{
+	OOBase::HeapAllocator::free(m_pending);
+}
+
+int BlockStoreReplica::open_source(const char* source)
 {
-	// Playback checkpoint file, updating store file
+	OOBase::LocalString dir_name;
+	OOBase::String file_name;
+	int err = OOBase::Paths::SplitDirAndFilename(source,dir_name,file_name);
+	if (err != 0)
+		return err;
+
+	Directory dir;
+	if ((err = dir.open(dir_name.c_str(),true)) == 0)
+		m_source = dir.open_file(file_name.c_str(),true,err);
 
-	int err = checkpoint_file.seek_begin(0);
 	if (err != 0)
 		return err;
 
-	// Check the start of the checkpoint file to see if it has a matching ID
-	if (validate)
+	// Remember which journal we are reading, unless it is a pipe
+	JournalHeader header = {0};
+	size_t len = m_source.read_at(0,&header,sizeof(header),err);
+	if (err == ESPIPE)
 	{
-		if ((err = validate_checkpoint_file(checkpoint_file)) != 0)
-			return err;
+		m_source_seekable = false;
+		err = 0;
 	}
+	else if (err == 0 && len == sizeof(header) && header.m_magic == s_journal_magic)
+		m_source_start = header.m_start_transaction;
 
-	for (;;)
+	return err;
+}
+
+int BlockStoreReplica::check_source(bool& restarted)
+{
+	// The primary restarts its journal by truncating it and writing a new header
+	// before any new transaction, and each restart starts after a later transaction.
+	// Its length alone can't tell us, as it may have grown back past where we are.
+	restarted = false;
+	if (!m_source_seekable)
+		return 0;
+
+	JournalHeader header = {0};
+	int err = 0;
+	size_t len = m_source.read_at(0,&header,sizeof(header),err);
+	if (err != 0 || len != sizeof(header) || header.m_magic != s_journal_magic || header.m_start_transaction == m_source_start)
+		return err;
+
+	// Start again from the top, skipping what we already have
+	m_source_start = header.m_start_transaction;
+	m_pending_len = 0;
+	restarted = true;
+
+	return m_source.seek_begin(0);
+}
+
+int BlockStoreReplica::replicate(id_t& last_trans_id, const OOBase::Timeout& timeout)
+{
+	// Replicated transactions are written just like our own, so exclude checkpoints
+	OOBase::Guard<OOBase::Condition::Mutex> guard(m_write_lock,false);
+	if (!guard.acquire(timeout))
+		return ETIMEDOUT;
+
+	while (m_write_inprogress)
 	{
-		id_t block_id;
-		if (!checkpoint_file.read(block_id,err))
-			break;
+		if (!m_write_condition.wait(m_write_lock,timeout))
+			return ETIMEDOUT;
+	}
+
+	m_write_inprogress = true;
 
-		void* TODO; // Fix the byte_swap!
+	int err = 0;
+	bool restarted = false;
+	while (err == 0)
+	{
+		// If the primary has checkpointed and restarted its journal, start again from the top
+		if ((err = check_source(restarted)) != 0)
+			break;
 
-		block_id = OOBase::byte_swap(block_id);
-		if (block_id == 0)
+		if (m_pending_size - m_pending_len < LogBuffer::s_chunk_size)
 		{
-			// Special size for first block
-			void* TODO;
+			char* new_pending = static_cast<char*>(OOBase::HeapAllocator::reallocate(m_pending,m_pending_len + LogBuffer::s_chunk_size));
+			if (!new_pending)
+			{
+				err = ERROR_OUTOFMEMORY;
+				break;
+			}
+
+			m_pending = new_pending;
+			m_pending_size = m_pending_len + LogBuffer::s_chunk_size;
 		}
-		else
+
+		size_t len = m_source.read_some(m_pending + m_pending_len,m_pending_size - m_pending_len,err);
+		if (err != 0 || len == 0)
+			break;
+
+		// A restart part way through the read means we can't tell which journal it came from
+		if ((err = check_source(restarted)) != 0 || restarted)
+			continue;
+
+		m_pending_len += len;
+
+		// Apply every complete transaction we have, leaving any partial one for next time
+		size_t used = 0;
+		while (err == 0 && m_pending_len - used >= 3 * sizeof(uint64_t))
 		{
-			void* TODO;
+			uint64_t header[3];
+			memcpy(header,m_pending + used,sizeof(header));
+
+			// The journal starts with its own header
+			if (header[0] == s_journal_magic)
+			{
+				JournalHeader journal_header;
+				memcpy(&journal_header,m_pending + used,sizeof(journal_header));
+				if (!is_known_journal_version(journal_header.m_version) || journal_header.m_block_size != m_block_size)
+					err = EINVAL;
+				else
+					used += sizeof(journal_header);
+				continue;
+			}
+
+			uint64_t total = sizeof(header) + header[2];
+			if (!is_begin(header[0]) || total <= sizeof(header))
+				err = EINVAL;
+			else if (m_pending_len - used < total)
+				break;
+			else if ((err = apply_shipped(m_pending + used,static_cast<size_t>(total))) == 0)
+				used += static_cast<size_t>(total);
 		}
+
+		memmove(m_pending,m_pending + used,m_pending_len - used);
+		m_pending_len -= used;
 	}
 
-	// Sync store file
+	m_write_inprogress = false;
+	m_write_condition.signal();
+
+	last_trans_id = m_last_transaction;
+	return err;
+}
+
+int BlockStoreReplica::apply_shipped(const char* data, size_t length)
+{
+	// Caller must hold m_write_lock
+	uint64_t header[3];
+	memcpy(header,data,sizeof(header));
+
+	// Skip anything we already have, e.g. after the primary's journal restarts
+	id_t trans_id = header[1];
+	if (trans_id <= m_last_transaction)
+		return 0;
+
+	// A gap means the primary checkpointed transactions away before we saw them,
+	// the only cure is to re-seed this store from a backup
+	if (trans_id != m_last_transaction+1)
+		return EINVAL;
+
+	// Validate the records and gather the blocks they touch
+	m_log_block_ids.clear();
+	ShippedCollector collector = { &m_log_block_ids, m_block_count };
+	int err = walk_transaction(m_block_size,header[0] == LogRecord::BeginCompact,data + sizeof(header),length - sizeof(header),collector);
 	if (err == 0)
-		err = m_store_file.sync();
+	{
+		// The records are already in our journal format, so append them verbatim
+		File::IOBuffer buf = { data, length };
+		err = append_transaction(&buf,1,trans_id,collector.m_block_count,m_log_block_ids);
+	}
 
+	m_log_block_ids.clear();
 	return err;
 }
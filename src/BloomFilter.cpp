@@ -0,0 +1,393 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "config-kv.h"
+
+#include "../include/BloomFilter.h"
+#include "Hash.h"
+
+#include <string.h>
+
+using namespace OOKv;
+
+namespace
+{
+	static const uint64_t s_magic = 0x4D6F6F6C42764B4FULL; // "OKvBlooM"
+
+	// Bits live in 64 byte lines of 8 words, the first line holds the header
+	static const size_t s_line_words = 8;
+	static const size_t s_line_bytes = s_line_words * sizeof(uint64_t);
+	static const size_t s_max_probes = 16;
+
+	// m_changes counts the flushes, so other instances can tell when to reload
+	struct Header
+	{
+		uint64_t m_magic;
+		uint32_t m_page_count;
+		uint32_t m_probes;
+		uint64_t m_lines;
+		uint64_t m_changes;
+	};
+
+	uint64_t hash(const void* key, size_t length)
+	{
+		// FNV-1a, finished with a mix so every output bit depends on every input bit
+		const unsigned char* p = static_cast<const unsigned char*>(key);
+		uint64_t h = 0xCBF29CE484222325ULL;
+		while (length--)
+		{
+			h ^= *p++;
+			h *= 0x100000001B3ULL;
+		}
+		return mix64(h);
+	}
+}
+
+BloomFilter::BloomFilter(BlockStore* store) :
+		m_store(store),
+		m_root(0),
+		m_block_size(store->block_size()),
+		m_page_count(0),
+		m_lines(0),
+		m_probes(0),
+		m_bits(NULL),
+		m_dirty(NULL),
+		m_new(false),
+		m_create_trans_id(0)
+{
+	m_store->addref();
+}
+
+BloomFilter::~BloomFilter()
+{
+	free();
+	m_store->release();
+}
+
+void BloomFilter::free()
+{
+	OOBase::HeapAllocator::free(m_bits);
+	OOBase::HeapAllocator::free(m_dirty);
+	m_bits = NULL;
+	m_dirty = NULL;
+	m_page_count = 0;
+}
+
+int BloomFilter::alloc(size_t page_count)
+{
+	free();
+
+	m_bits = static_cast<uint64_t*>(OOBase::HeapAllocator::allocate(page_count * m_block_size));
+	m_dirty = static_cast<bool*>(OOBase::HeapAllocator::allocate(page_count * sizeof(bool)));
+	if (!m_bits || !m_dirty)
+	{
+		free();
+		return ERROR_OUTOFMEMORY;
+	}
+
+	memset(m_bits,0,page_count * m_block_size);
+	memset(m_dirty,0,page_count * sizeof(bool));
+	m_page_count = page_count;
+	return 0;
+}
+
+int BloomFilter::create(const id_t& trans_id, size_t expected_keys, size_t bits_per_key)
+{
+	if (!expected_keys || !bits_per_key)
+		return EINVAL;
+
+	// k = bits_per_key * ln 2 is optimal
+	size_t probes = (bits_per_key * 69 + 50) / 100;
+	if (probes < 1)
+		probes = 1;
+	else if (probes > s_max_probes)
+		probes = s_max_probes;
+
+	size_t lines = (expected_keys * bits_per_key + s_line_bytes * 8 - 1) / (s_line_bytes * 8);
+	size_t page_count = ((lines + 1) * s_line_bytes + m_block_size - 1) / m_block_size;
+
+	int err = 0;
+	id_t root_id = m_store->alloc_extent(trans_id,page_count,err);
+	if (err != 0)
+		return err;
+
+	OOBase::Guard<OOBase::RWMutex> guard(m_lock);
+
+	if ((err = alloc(page_count)) != 0)
+		return err;
+
+	// Use all the space we have
+	m_root = root_id;
+	m_lines = (page_count * m_block_size) / s_line_bytes - 1;
+	m_probes = probes;
+	m_new = true;
+	m_create_trans_id = trans_id;
+
+	Header* header = reinterpret_cast<Header*>(m_bits);
+	header->m_magic = s_magic;
+	header->m_page_count = static_cast<uint32_t>(page_count);
+	header->m_probes = static_cast<uint32_t>(probes);
+	header->m_lines = m_lines;
+
+	return 0;
+}
+
+int BloomFilter::open(const id_t& root_id, const id_t& trans_id)
+{
+	return load(root_id,trans_id,false);
+}
+
+int BloomFilter::refresh(const id_t& trans_id)
+{
+	if (!m_bits)
+		return EINVAL;
+
+	// Nobody else can see a filter that isn't flushed yet
+	if (m_new)
+		return 0;
+
+	Header header;
+	int err = m_store->read_extent(m_root,trans_id,0,&header,sizeof(header));
+	if (err != 0 || header.m_changes == reinterpret_cast<const Header*>(m_bits)->m_changes)
+		return err;
+
+	return load(m_root,trans_id,true);
+}
+
+int BloomFilter::load(const id_t& root_id, const id_t& trans_id, bool keep)
+{
+	Header header;
+	int err = m_store->read_extent(root_id,trans_id,0,&header,sizeof(header));
+	if (err != 0)
+		return err;
+
+	if (header.m_magic != s_magic || !header.m_page_count || !header.m_probes || header.m_probes > s_max_probes ||
+			(header.m_lines + 1) * s_line_bytes > header.m_page_count * m_block_size)
+	{
+		return EINVAL;
+	}
+
+	// Read into a new copy, so a failure leaves the old one alone
+	size_t bytes = header.m_page_count * m_block_size;
+	uint64_t* bits = static_cast<uint64_t*>(OOBase::HeapAllocator::allocate(bytes));
+	bool* dirty = static_cast<bool*>(OOBase::HeapAllocator::allocate(header.m_page_count * sizeof(bool)));
+	if (!bits || !dirty)
+		err = ERROR_OUTOFMEMORY;
+	else
+		err = m_store->read_extent(root_id,trans_id,0,bits,bytes);
+
+	if (err != 0)
+	{
+		OOBase::HeapAllocator::free(bits);
+		OOBase::HeapAllocator::free(dirty);
+		return err;
+	}
+
+	memset(dirty,0,header.m_page_count * sizeof(bool));
+
+	OOBase::Guard<OOBase::RWMutex> guard(m_lock);
+
+	// Keep the keys we added ourselves, committed or not, but not our old header
+	if (keep && m_bits && header.m_page_count == m_page_count)
+	{
+		for (size_t i = s_line_words; i < bytes / sizeof(uint64_t); ++i)
+			bits[i] |= m_bits[i];
+
+		memcpy(dirty,m_dirty,m_page_count * sizeof(bool));
+	}
+
+	free();
+
+	m_bits = bits;
+	m_dirty = dirty;
+	m_page_count = header.m_page_count;
+	m_root = root_id;
+	m_lines = static_cast<size_t>(header.m_lines);
+	m_probes = header.m_probes;
+	m_new = false;
+	return 0;
+}
+
+void BloomFilter::make_mask(const void* key, size_t length, size_t& line, uint64_t mask[s_line_words]) const
+{
+	uint64_t h = hash(key,length);
+
+	// Map the top half onto [0,m_lines) without a divide
+	line = static_cast<size_t>(((h >> 32) * m_lines) >> 32) + 1;
+
+	// Double hashing picks the bits within the line
+	uint64_t g = mix64(h ^ 0x9E3779B97F4A7C15ULL);
+	size_t bit = static_cast<size_t>(g);
+	size_t step = static_cast<size_t>(g >> 32) | 1;
+
+	memset(mask,0,s_line_words * sizeof(uint64_t));
+	for (size_t i = 0; i < m_probes; ++i, bit += step)
+		mask[(bit >> 6) & (s_line_words - 1)] |= uint64_t(1) << (bit & 63);
+}
+
+bool BloomFilter::may_contain(const void* key, size_t length) const
+{
+	OOBase::ReadGuard<OOBase::RWMutex> guard(m_lock);
+
+	if (!m_bits)
+		return true;
+
+	size_t line;
+	uint64_t mask[s_line_words];
+	make_mask(key,length,line,mask);
+
+	// Test the whole line at once, the compiler can vectorise this
+	const uint64_t* w = m_bits + line * s_line_words;
+	uint64_t missing = 0;
+	for (size_t i = 0; i < s_line_words; ++i)
+		missing |= mask[i] & ~w[i];
+
+	return (missing == 0);
+}
+
+void BloomFilter::add(const void* key, size_t length)
+{
+	OOBase::Guard<OOBase::RWMutex> guard(m_lock);
+
+	if (!m_bits)
+		return;
+
+	size_t line;
+	uint64_t mask[s_line_words];
+	make_mask(key,length,line,mask);
+
+	uint64_t* w = m_bits + line * s_line_words;
+	bool changed = false;
+	for (size_t i = 0; i < s_line_words; ++i)
+	{
+		changed |= ((mask[i] & ~w[i]) != 0);
+		w[i] |= mask[i];
+	}
+
+	if (changed)
+		m_dirty[(line * s_line_bytes) / m_block_size] = true;
+}
+
+int BloomFilter::flush(const id_t& trans_id)
+{
+	if (!m_bits)
+		return EINVAL;
+
+	int err = 0;
+	if (m_new)
+	{
+		// A new filter is logged whole
+		if ((err = m_store->write_extent(m_root,trans_id,0,m_bits,m_page_count * m_block_size)) == 0)
+		{
+			m_new = false;
+			memset(m_dirty,0,m_page_count * sizeof(bool));
+		}
+		return err;
+	}
+
+	size_t p = 0;
+	while (p < m_page_count && !m_dirty[p])
+		++p;
+
+	if (p == m_page_count)
+		return 0;
+
+	// Count the change in the header, so other instances know to refresh
+	m_dirty[0] = true;
+
+	// Nobody else can have added to a filter created in this transaction
+	bool merge = (trans_id != m_create_trans_id);
+
+	// Otherwise just the pages that changed, as diffs
+	size_t page_words = m_block_size / sizeof(uint64_t);
+	for (p = 0; err == 0 && p < m_page_count; ++p)
+	{
+		if (!m_dirty[p])
+			continue;
+
+		// Read the committed page before taking the lock
+		BlockStore::Block committed;
+		if (merge)
+		{
+			committed = m_store->get_block(m_root + p,trans_id-1,err);
+			if (err != 0)
+				break;
+		}
+
+		void* data = OOBase::HeapAllocator::allocate(m_block_size);
+		if (!data)
+			return ERROR_OUTOFMEMORY;
+
+		OOBase::Guard<OOBase::RWMutex> guard(m_lock);
+
+		uint64_t* ours = m_bits + p * page_words;
+		Header* header = (p == 0 ? reinterpret_cast<Header*>(ours) : NULL);
+		bool stale = false;
+		if (merge)
+		{
+			// Merge in the keys other instances have committed since we loaded,
+			// or flushing our copy would lose them
+			const uint64_t* theirs = static_cast<const uint64_t*>(static_cast<const void*>(committed));
+			for (size_t i = (header ? s_line_words : 0); i < page_words; ++i)
+				ours[i] |= theirs[i];
+
+			if (header)
+			{
+				stale = (header->m_changes != reinterpret_cast<const Header*>(theirs)->m_changes);
+				header->m_changes = reinterpret_cast<const Header*>(theirs)->m_changes;
+			}
+		}
+
+		if (header)
+			++header->m_changes;
+
+		memcpy(data,ours,m_block_size);
+
+		// Our other pages may still miss their keys, so make the next refresh() reload
+		if (stale)
+			header->m_changes = 0;
+
+		guard.release();
+
+		err = m_store->update_block(m_root + p,trans_id,BlockStore::Block(data));
+	}
+
+	if (err == 0)
+		memset(m_dirty,0,m_page_count * sizeof(bool));
+
+	return err;
+}
+
+void BloomFilter::discard(const id_t& trans_id)
+{
+	// A filter created by the transaction never existed.  Otherwise the keys
+	// added by it stay in our copy, which only costs false positives,
+	// and our header no longer matches so the next refresh() reloads.
+	if (trans_id == m_create_trans_id)
+	{
+		OOBase::Guard<OOBase::RWMutex> guard(m_lock);
+
+		free();
+		m_root = 0;
+		m_new = false;
+		m_create_trans_id = 0;
+	}
+}
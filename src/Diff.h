@@ -0,0 +1,213 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_DIFF_H_INCLUDED_
+#define OOKV_DIFF_H_INCLUDED_
+
+#include "LogBuffer.h"
+#include "Varint.h"
+
+namespace OOKv
+{
+	// A block diff is a sequence of varint run markers of (run << 1 | changed)
+	// covering the whole block, each changed run followed by its replacement bytes,
+	// so the short runs typical of small updates cost a single byte.
+	//
+	// Version 1 journals used 16-bit markers instead: the top bit set for a changed
+	// run, with runs capped at 15 bits.  Those are only ever read now.
+	namespace Diff
+	{
+		static const size_t s_max_run = 0x7FFF;
+
+		inline bool is_valid_block_size(size_t block_size)
+		{
+			switch (block_size)
+			{
+			case 4096:
+			case 8192:
+			case 16384:
+			case 32768:
+			case 65536:
+				return true;
+
+			default:
+				return false;
+			}
+		}
+
+		// Apply a 16-bit marker diff of at most length bytes to data, or just measure it if data is NULL.
+		// Returns the number of diff bytes consumed, or 0 if the diff is malformed.
+		template <size_t S>
+		size_t apply(char* data, const char* diff, size_t length)
+		{
+			size_t used = 0;
+			for (size_t pos = 0; pos < S;)
+			{
+				uint16_t marker;
+				if (length - used < sizeof(marker))
+					return 0;
+
+				memcpy(&marker,diff + used,sizeof(marker));
+				used += sizeof(marker);
+
+				size_t run = (marker & s_max_run);
+				if (run == 0 || run > S - pos)
+					return 0;
+
+				if (marker & 0x8000)
+				{
+					if (length - used < run)
+						return 0;
+
+					if (data)
+						memcpy(data + pos,diff + used,run);
+
+					used += run;
+				}
+
+				pos += run;
+			}
+
+			return used;
+		}
+
+		template <size_t S>
+		bool write_compact(LogBuffer& log, const char* prev_data, const char* data)
+		{
+			unsigned char marker[Varint::s_max_length];
+			for (size_t pos = 0; pos < S;)
+			{
+				size_t start = pos;
+				for (;pos < S && prev_data[pos] == data[pos];++pos)
+					;
+
+				if (pos != start && !log.write(marker,Varint::encode((pos - start) << 1,marker)))
+					return false;
+
+				start = pos;
+				for (;pos < S && prev_data[pos] != data[pos];++pos)
+					;
+
+				if (pos != start)
+				{
+					if (!log.write(marker,Varint::encode(((pos - start) << 1) | 1,marker)) || !log.write_ref(data + start,pos - start))
+						return false;
+				}
+			}
+
+			return true;
+		}
+
+		template <size_t S>
+		size_t apply_compact(char* data, const char* diff, size_t length)
+		{
+			size_t used = 0;
+			for (size_t pos = 0; pos < S;)
+			{
+				uint64_t marker;
+				size_t len = Varint::decode(diff + used,length - used,marker);
+				if (!len)
+					return 0;
+
+				used += len;
+
+				uint64_t run = (marker >> 1);
+				if (run == 0 || run > S - pos)
+					return 0;
+
+				if (marker & 1)
+				{
+					if (length - used < run)
+						return 0;
+
+					if (data)
+						memcpy(data + pos,diff + used,static_cast<size_t>(run));
+
+					used += static_cast<size_t>(run);
+				}
+
+				pos += static_cast<size_t>(run);
+			}
+
+			return used;
+		}
+
+		// Runtime dispatch to the kernel for each supported block size
+		inline size_t apply(size_t block_size, char* data, const char* diff, size_t length)
+		{
+			switch (block_size)
+			{
+			case 4096:
+				return apply<4096>(data,diff,length);
+			case 8192:
+				return apply<8192>(data,diff,length);
+			case 16384:
+				return apply<16384>(data,diff,length);
+			case 32768:
+				return apply<32768>(data,diff,length);
+			case 65536:
+				return apply<65536>(data,diff,length);
+			default:
+				return 0;
+			}
+		}
+
+		inline bool write_compact(size_t block_size, LogBuffer& log, const char* prev_data, const char* data)
+		{
+			switch (block_size)
+			{
+			case 4096:
+				return write_compact<4096>(log,prev_data,data);
+			case 8192:
+				return write_compact<8192>(log,prev_data,data);
+			case 16384:
+				return write_compact<16384>(log,prev_data,data);
+			case 32768:
+				return write_compact<32768>(log,prev_data,data);
+			case 65536:
+				return write_compact<65536>(log,prev_data,data);
+			default:
+				return false;
+			}
+		}
+
+		inline size_t apply_compact(size_t block_size, char* data, const char* diff, size_t length)
+		{
+			switch (block_size)
+			{
+			case 4096:
+				return apply_compact<4096>(data,diff,length);
+			case 8192:
+				return apply_compact<8192>(data,diff,length);
+			case 16384:
+				return apply_compact<16384>(data,diff,length);
+			case 32768:
+				return apply_compact<32768>(data,diff,length);
+			case 65536:
+				return apply_compact<65536>(data,diff,length);
+			default:
+				return 0;
+			}
+		}
+	}
+}
+
+#endif // OOKV_DIFF_H_INCLUDED_
@@ -21,3 +21,610 @@
 
 #include "File.h"
 
+
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
+
+#if defined(HAVE_SYS_UIO_H)
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_POLL_H)
+#include <poll.h>
+#endif
+
+#if defined(HAVE_SYS_FILE_H)
+#include <sys/file.h>
+#endif
+
+#if defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#endif
+
+#if defined(HAVE_UNISTD_H)
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if !defined(O_CLOEXEC)
+#define O_CLOEXEC 0
+#endif
+
+#if !defined(O_DIRECTORY)
+#define O_DIRECTORY 0
+#endif
+
+OOKv::File::File() : m_fd(-1)
+{
+}
+
+OOKv::File::File(int fd) : m_fd(fd)
+{
+}
+
+OOKv::File::File(const File& rhs) : m_fd(-1)
+{
+	// Each copy owns its own descriptor, sharing the open file and its position
+	if (rhs.m_fd != -1)
+	{
+		while ((m_fd = ::dup(rhs.m_fd)) < 0 && errno == EINTR)
+			;
+	}
+}
+
+OOKv::File::~File()
+{
+	close();
+}
+
+OOKv::File& OOKv::File::operator = (const File& rhs)
+{
+	if (this != &rhs)
+	{
+		File copy(rhs);
+		close();
+		m_fd = copy.m_fd;
+		copy.m_fd = -1;
+	}
+	return *this;
+}
+
+bool OOKv::File::is_open() const
+{
+	return (m_fd != -1);
+}
+
+int OOKv::File::close()
+{
+	if (m_fd == -1)
+		return 0;
+
+	// The descriptor is gone whatever close() says, so never retry it
+	int err = (::close(m_fd) == 0 ? 0 : errno);
+	m_fd = -1;
+	return (err == EINTR ? 0 : err);
+}
+
+int OOKv::File::write(const void* data, size_t length)
+{
+	const char* p = static_cast<const char*>(data);
+	while (length)
+	{
+		ssize_t len = ::write(m_fd,p,length);
+		if (len < 0)
+		{
+			if (errno != EINTR)
+				return errno;
+		}
+		else
+		{
+			p += len;
+			length -= static_cast<size_t>(len);
+		}
+	}
+	return 0;
+}
+
+bool OOKv::File::read(void* data, size_t length, int& err)
+{
+	// Returns true only if all length bytes were read
+	char* p = static_cast<char*>(data);
+	err = 0;
+	while (length)
+	{
+		ssize_t len = ::read(m_fd,p,length);
+		if (len == 0)
+			return false;
+
+		if (len < 0)
+		{
+			if (errno != EINTR)
+			{
+				err = errno;
+				return false;
+			}
+		}
+		else
+		{
+			p += len;
+			length -= static_cast<size_t>(len);
+		}
+	}
+	return true;
+}
+
+int OOKv::File::lock()
+{
+	// Exclusive and non-blocking: a second writer fails rather than waits
+#if defined(HAVE_SYS_FILE_H)
+	while (::flock(m_fd,LOCK_EX | LOCK_NB) != 0)
+	{
+		if (errno == EWOULDBLOCK)
+			return EBUSY;
+
+		if (errno != EINTR)
+			return errno;
+	}
+#else
+	struct flock fl = {0};
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	while (::fcntl(m_fd,F_SETLK,&fl) != 0)
+	{
+		if (errno == EACCES || errno == EAGAIN)
+			return EBUSY;
+
+		if (errno != EINTR)
+			return errno;
+	}
+#endif
+	return 0;
+}
+
+int OOKv::File::unlock()
+{
+#if defined(HAVE_SYS_FILE_H)
+	if (::flock(m_fd,LOCK_UN) != 0)
+		return errno;
+#else
+	struct flock fl = {0};
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	if (::fcntl(m_fd,F_SETLK,&fl) != 0)
+		return errno;
+#endif
+	return 0;
+}
+
+int OOKv::File::length(uint64_t& len) const
+{
+	struct stat st;
+	if (::fstat(m_fd,&st) != 0)
+		return errno;
+
+	len = static_cast<uint64_t>(st.st_size);
+	return 0;
+}
+
+int OOKv::File::tell(uint64_t& pos) const
+{
+	off_t off = ::lseek(m_fd,0,SEEK_CUR);
+	if (off < 0)
+		return errno;
+
+	pos = static_cast<uint64_t>(off);
+	return 0;
+}
+
+int OOKv::File::seek_begin(uint64_t pos)
+{
+	return (::lseek(m_fd,static_cast<off_t>(pos),SEEK_SET) < 0 ? errno : 0);
+}
+
+int OOKv::File::seek_cur(int64_t pos)
+{
+	return (::lseek(m_fd,static_cast<off_t>(pos),SEEK_CUR) < 0 ? errno : 0);
+}
+
+int OOKv::File::seek_end(uint64_t pos)
+{
+	return (::lseek(m_fd,static_cast<off_t>(pos),SEEK_END) < 0 ? errno : 0);
+}
+
+int OOKv::File::truncate(uint64_t len)
+{
+	while (::ftruncate(m_fd,static_cast<off_t>(len)) != 0)
+	{
+		if (errno != EINTR)
+			return errno;
+	}
+	return 0;
+}
+
+int OOKv::File::sync()
+{
+	while (::fsync(m_fd) != 0)
+	{
+		if (errno != EINTR)
+			return errno;
+	}
+	return 0;
+}
+
+OOKv::Directory::Directory() : m_fd(-1)
+{
+}
+
+OOKv::Directory::~Directory()
+{
+	if (m_fd != -1)
+		::close(m_fd);
+}
+
+int OOKv::Directory::open(const char* pszName, bool /*read_only*/)
+{
+	// Files are opened relative to the directory, so it can not be renamed from under us
+	if (!pszName || !*pszName)
+		pszName = ".";
+
+	int fd = -1;
+	while ((fd = ::open(pszName,O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	{
+		if (errno != EINTR)
+			return errno;
+	}
+
+	// Write access is checked as each file is opened
+	if (m_fd != -1)
+		::close(m_fd);
+	m_fd = fd;
+	return 0;
+}
+
+OOKv::File OOKv::Directory::open_file(const char* pszName, bool read_only, int& err)
+{
+	int fd = -1;
+	while ((fd = ::openat(m_fd,pszName,(read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0)
+	{
+		if (errno != EINTR)
+		{
+			err = errno;
+			return File();
+		}
+	}
+
+	err = 0;
+	return File(fd);
+}
+
+OOKv::File OOKv::Directory::create_file(const char* pszName, bool truncate_existing, int& err)
+{
+	int fd = -1;
+	while ((fd = ::openat(m_fd,pszName,O_RDWR | O_CREAT | O_CLOEXEC | (truncate_existing ? O_TRUNC : 0),0666)) < 0)
+	{
+		if (errno != EINTR)
+		{
+			err = errno;
+			return File();
+		}
+	}
+
+	err = 0;
+	return File(fd);
+}
+
+bool OOKv::Directory::file_exists(const char* pszName)
+{
+	struct stat st;
+	return (::fstatat(m_fd,pszName,&st,0) == 0);
+}
+
+int OOKv::Directory::remove_file(const char* pszName)
+{
+	return (::unlinkat(m_fd,pszName,0) == 0 ? 0 : errno);
+}
+
+size_t OOKv::File::read_some(void* data, size_t length, int& err)
+{
+#if defined(HAVE_POLL_H)
+	// Pipes would block on read, so check there is something to read first
+	pollfd p = { m_fd, POLLIN, 0 };
+	int r = 0;
+	while ((r = ::poll(&p,1,0)) < 0 && errno == EINTR)
+		;
+
+	if (r < 0)
+	{
+		err = errno;
+		return 0;
+	}
+
+	err = 0;
+	if (r == 0)
+		return 0;
+#endif
+
+	for (;;)
+	{
+		ssize_t len = ::read(m_fd,data,length);
+		if (len >= 0)
+		{
+			err = 0;
+			return static_cast<size_t>(len);
+		}
+
+		if (errno != EINTR)
+		{
+			err = errno;
+			return 0;
+		}
+	}
+}
+
+size_t OOKv::File::read_at(uint64_t pos, void* data, size_t length, int& err) const
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t r = ::pread(m_fd,static_cast<char*>(data) + done,length - done,static_cast<off_t>(pos + done));
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			err = errno;
+			return done;
+		}
+
+		// End of file
+		if (r == 0)
+			break;
+
+		done += static_cast<size_t>(r);
+	}
+
+	err = 0;
+	return done;
+}
+
+int OOKv::File::write_at(uint64_t pos, const void* data, size_t length)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t w = ::pwrite(m_fd,static_cast<const char*>(data) + done,length - done,static_cast<off_t>(pos + done));
+		if (w < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return errno;
+		}
+
+		done += static_cast<size_t>(w);
+	}
+
+	return 0;
+}
+
+int OOKv::File::copy_to(File& dest, uint64_t pos, uint64_t length) const
+{
+	// Copy in the kernel if we can: file to file with copy_file_range,
+	// else to anything, e.g. a pipe or a socket, with sendfile
+	bool in_kernel = true;
+
+#if defined(HAVE_COPY_FILE_RANGE)
+	while (in_kernel && length)
+	{
+		loff_t in_pos = static_cast<loff_t>(pos);
+		size_t len = (length > 0x40000000 ? 0x40000000 : static_cast<size_t>(length));
+
+		ssize_t c = ::copy_file_range(m_fd,&in_pos,dest.m_fd,NULL,len,0);
+		if (c < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// Not file to file, different filesystems, or no kernel support
+			if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EBADF || errno == EOPNOTSUPP)
+				break;
+
+			return errno;
+		}
+
+		// The rest is past the end of this file
+		if (c == 0)
+			in_kernel = false;
+
+		pos += c;
+		length -= c;
+	}
+#endif
+
+#if defined(HAVE_SYS_SENDFILE_H)
+	while (in_kernel && length)
+	{
+		off_t in_pos = static_cast<off_t>(pos);
+		size_t len = (length > 0x40000000 ? 0x40000000 : static_cast<size_t>(length));
+
+		ssize_t c = ::sendfile(dest.m_fd,m_fd,&in_pos,len);
+		if (c < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == ENOSYS || errno == EINVAL)
+				break;
+
+			return errno;
+		}
+
+		if (c == 0)
+			in_kernel = false;
+
+		pos += c;
+		length -= c;
+	}
+#endif
+
+	// Copy what is left by hand
+	char buf[64 * 1024];
+	while (length)
+	{
+		int err = 0;
+		size_t want = (length > sizeof(buf) ? sizeof(buf) : static_cast<size_t>(length));
+		size_t len = read_at(pos,buf,want,err);
+		if (err != 0)
+			return err;
+
+		// Past the end of file, as for a sparse file
+		if (len < want)
+		{
+			memset(buf + len,0,want - len);
+			len = want;
+		}
+
+		if ((err = dest.write(buf,len)) != 0)
+			return err;
+
+		pos += len;
+		length -= len;
+	}
+
+	return 0;
+}
+
+OOKv::File OOKv::File::dup_fd(int fd, int& err)
+{
+	int new_fd = -1;
+	while ((new_fd = ::dup(fd)) < 0 && errno == EINTR)
+		;
+
+	err = (new_fd < 0 ? errno : 0);
+	return File(new_fd);
+}
+
+int OOKv::File::data_sync()
+{
+#if defined(HAVE_FDATASYNC)
+	while (::fdatasync(m_fd) != 0)
+	{
+		if (errno != EINTR)
+			return errno;
+	}
+	return 0;
+#else
+	return sync();
+#endif
+}
+
+int OOKv::File::allocate(uint64_t offset, uint64_t length, bool keep_size)
+{
+#if defined(HAVE_FALLOCATE)
+	while (::fallocate(m_fd,keep_size ? FALLOC_FL_KEEP_SIZE : 0,static_cast<off_t>(offset),static_cast<off_t>(length)) != 0)
+	{
+		if (errno == EOPNOTSUPP)
+			return ENOTSUP;
+
+		if (errno != EINTR)
+			return errno;
+	}
+	return 0;
+#elif defined(HAVE_POSIX_FALLOCATE)
+	// posix_fallocate always extends the file
+	if (keep_size)
+		return ENOTSUP;
+
+	return ::posix_fallocate(m_fd,static_cast<off_t>(offset),static_cast<off_t>(length));
+#else
+	return ENOTSUP;
+#endif
+}
+
+int OOKv::File::writev(const IOBuffer* buffers, size_t count)
+{
+#if defined(HAVE_SYS_UIO_H)
+	struct iovec iov[64];
+
+	while (count)
+	{
+		// Gather up to 64 buffers at a time
+		size_t n = 0;
+		for (;n < count && n < sizeof(iov)/sizeof(iov[0]); ++n)
+		{
+			iov[n].iov_base = const_cast<void*>(buffers[n].m_data);
+			iov[n].iov_len = buffers[n].m_length;
+		}
+
+		size_t done = 0;
+		while (done < n)
+		{
+			ssize_t w = ::writev(m_fd,iov + done,static_cast<int>(n - done));
+			if (w < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				return errno;
+			}
+
+			// Skip past whatever was written, including partial buffers
+			size_t written = static_cast<size_t>(w);
+			while (done < n && written >= iov[done].iov_len)
+				written -= iov[done++].iov_len;
+
+			if (written)
+			{
+				iov[done].iov_base = static_cast<char*>(iov[done].iov_base) + written;
+				iov[done].iov_len -= written;
+			}
+		}
+
+		buffers += n;
+		count -= n;
+	}
+
+	return 0;
+#else
+	for (size_t i = 0; i < count; ++i)
+	{
+		int err = write(buffers[i].m_data,buffers[i].m_length);
+		if (err != 0)
+			return err;
+	}
+	return 0;
+#endif
+}
+
+void* OOKv::File::map(uint64_t offset, size_t length, bool read_only, int& err)
+{
+#if defined(HAVE_SYS_MMAN_H)
+	void* addr = ::mmap(NULL,length,read_only ? PROT_READ : PROT_READ | PROT_WRITE,MAP_SHARED,m_fd,static_cast<off_t>(offset));
+	if (addr == MAP_FAILED)
+	{
+		err = errno;
+		return NULL;
+	}
+
+	err = 0;
+	return addr;
+#else
+	err = ENOSYS;
+	return NULL;
+#endif
+}
+
+int OOKv::File::unmap(void* addr, size_t length)
+{
+#if defined(HAVE_SYS_MMAN_H)
+	if (::munmap(addr,length) != 0)
+		return errno;
+
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+#endif // defined(HAVE_UNISTD_H)
@@ -31,6 +31,12 @@ namespace OOKv
 		friend class Directory;
 
 	public:
+		struct IOBuffer
+		{
+			const void* m_data;
+			size_t      m_length;
+		};
+
 		File();
 		File(const File& rhs);
 		~File();
@@ -42,6 +48,21 @@ namespace OOKv
 		int write(const void* data, size_t length);
 		bool read(void* data, size_t length, int& err);
 
+		// Gathered write of count buffers at the current position
+		int writev(const IOBuffer* buffers, size_t count);
+
+		// Read whatever is available now without blocking, e.g. from a pipe, returns bytes read
+		size_t read_some(void* data, size_t length, int& err);
+
+		// Positional read and write that do not move the file pointer, read_at returns bytes read
+		size_t read_at(uint64_t pos, void* data, size_t length, int& err) const;
+		int write_at(uint64_t pos, const void* data, size_t length);
+
+		// Copy length bytes from pos to the current position of dest, which may be a
+		// pipe or a socket, in the kernel where possible.
+		// Anything past the end of this file is copied as zeros.
+		int copy_to(File& dest, uint64_t pos, uint64_t length) const;
+
 		template <typename T>
 		int write(T val)
 		{
@@ -66,11 +87,27 @@ namespace OOKv
 
 		int sync();
 
+		// Like sync(), but skips metadata that is not needed to read the data back
+		int data_sync();
+
+		// Reserve disk space for length bytes from offset, so later writes need not
+		// allocate, leaving the file length alone if keep_size.  ENOTSUP if unsupported.
+		int allocate(uint64_t offset, uint64_t length, bool keep_size);
+
+		// Map length bytes from offset into memory, shared with other processes
+		void* map(uint64_t offset, size_t length, bool read_only, int& err);
+		static int unmap(void* addr, size_t length);
+
 	private:
 #if defined(_WIN32)
 		File(HANDLE handle);
 		HANDLE m_handle;
 #elif defined(HAVE_UNISTD_H)
+	public:
+		// A File of our own for an fd the caller keeps, e.g. stdout
+		static File dup_fd(int fd, int& err);
+
+	private:
 		File(int fd);
 		int m_fd;
 #else
@@ -91,6 +128,16 @@ namespace OOKv
 
 		bool file_exists(const char* pszName);
 		int remove_file(const char* pszName);
+
+	private:
+		Directory(const Directory&);
+		Directory& operator = (const Directory&);
+
+#if defined(_WIN32)
+		HANDLE m_handle;
+#elif defined(HAVE_UNISTD_H)
+		int m_fd;
+#endif
 	};
 }
 
@@ -0,0 +1,635 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "config-kv.h"
+
+#include "../include/HashIndex.h"
+#include "Hash.h"
+
+#include <string.h>
+
+using namespace OOKv;
+
+namespace
+{
+	static const uint64_t s_magic = 0x4948736148764B4FULL; // "OKvHasHI"
+
+	// The root page holds the directory depth and the ids of the directory pages
+	struct RootHeader
+	{
+		uint64_t m_magic;
+		uint32_t m_global_depth;
+		uint32_t m_dir_page_count;
+	};
+
+	// A bucket page holds its depth and an unordered array of entries
+	struct BucketHeader
+	{
+		uint32_t m_local_depth;
+		uint32_t m_count;
+		uint64_t m_reserved;
+	};
+
+	struct Entry
+	{
+		uint64_t m_key;
+		uint64_t m_value;
+	};
+
+	// Distinct keys always have distinct hashes, and clustered keys still spread across the directory
+	inline uint64_t hash(uint64_t key)
+	{
+		return mix64(key);
+	}
+
+	inline id_t* dir_pages(char* root)
+	{
+		return reinterpret_cast<id_t*>(root + sizeof(RootHeader));
+	}
+
+	inline const id_t* dir_pages(const char* root)
+	{
+		return reinterpret_cast<const id_t*>(root + sizeof(RootHeader));
+	}
+
+	inline Entry* entries(char* bucket)
+	{
+		return reinterpret_cast<Entry*>(bucket + sizeof(BucketHeader));
+	}
+
+	inline const Entry* entries(const char* bucket)
+	{
+		return reinterpret_cast<const Entry*>(bucket + sizeof(BucketHeader));
+	}
+
+	inline char* data(const BlockStore::Block& block)
+	{
+		return static_cast<char*>(static_cast<void*>(block));
+	}
+
+	// How many snapshots' directories are cached at once
+	const size_t s_dir_snapshots = 4;
+}
+
+struct HashIndex::DirSnapshot
+{
+	uint32_t                          m_depth;
+	OOBase::Vector<id_t>              m_page_ids;
+	OOBase::Vector<BlockStore::Block> m_pages;
+};
+
+HashIndex::HashIndex(BlockStore* store, const id_t& root_id) :
+		m_store(store),
+		m_root(root_id),
+		m_block_size(store->block_size()),
+		m_write_trans_id(0),
+		m_dir_dirty(false)
+{
+	m_store->addref();
+}
+
+HashIndex::~HashIndex()
+{
+	clear_directories();
+
+	m_store->release();
+}
+
+void HashIndex::clear_directories()
+{
+	OOBase::Guard<OOBase::RWMutex> guard(m_dir_lock);
+
+	for (size_t i = 0; i < m_dirs.size(); ++i)
+		delete *m_dirs.at(i);
+
+	m_dirs.clear();
+}
+
+int HashIndex::begin_write(const id_t& trans_id)
+{
+	// Pages left over from an abandoned transaction are stale
+	if (trans_id != m_write_trans_id)
+	{
+		discard();
+		m_write_trans_id = trans_id;
+	}
+
+	return (m_root || !m_dirty.empty() ? 0 : EINVAL);
+}
+
+void HashIndex::discard()
+{
+	m_dirty.clear();
+	m_dir_dirty = false;
+	m_write_trans_id = 0;
+}
+
+const char* HashIndex::read_page(const id_t& trans_id, const id_t& block_id, BlockStore::Block& hold, int& err)
+{
+	// The write transaction sees its own changes, on top of the last committed version
+	if (trans_id == m_write_trans_id)
+	{
+		Page* page = m_dirty.find(block_id);
+		if (page)
+		{
+			err = 0;
+			return data(page->m_block);
+		}
+
+		hold = m_store->get_block(block_id,trans_id-1,err);
+	}
+	else
+		hold = m_store->get_block(block_id,trans_id,err);
+
+	return (err == 0 ? data(hold) : NULL);
+}
+
+char* HashIndex::write_page(const id_t& trans_id, const id_t& block_id, int& err)
+{
+	Page* page = m_dirty.find(block_id);
+	if (page)
+	{
+		err = 0;
+		return data(page->m_block);
+	}
+
+	// Copy on write, the cached block is shared with readers
+	BlockStore::Block prev = m_store->get_block(block_id,trans_id-1,err);
+	if (err != 0)
+		return NULL;
+
+	char* ptr = static_cast<char*>(OOBase::HeapAllocator::allocate(m_block_size));
+	if (!ptr)
+	{
+		err = ERROR_OUTOFMEMORY;
+		return NULL;
+	}
+	memcpy(ptr,data(prev),m_block_size);
+
+	Page new_page = { BlockStore::Block(ptr), false };
+	if ((err = m_dirty.insert(block_id,new_page)) != 0)
+		return NULL;
+
+	return ptr;
+}
+
+char* HashIndex::new_page(const id_t& trans_id, id_t& block_id, int& err)
+{
+	block_id = m_store->alloc_extent(trans_id,1,err);
+	if (err != 0)
+		return NULL;
+
+	char* ptr = static_cast<char*>(OOBase::HeapAllocator::allocate(m_block_size));
+	if (!ptr)
+	{
+		err = ERROR_OUTOFMEMORY;
+		return NULL;
+	}
+	memset(ptr,0,m_block_size);
+
+	Page page = { BlockStore::Block(ptr), true };
+	if ((err = m_dirty.insert(block_id,page)) != 0)
+		return NULL;
+
+	return ptr;
+}
+
+int HashIndex::create(const id_t& trans_id)
+{
+	m_root = 0;
+	begin_write(trans_id);
+
+	// Anything cached was for the old root
+	clear_directories();
+
+	id_t root_id = 0;
+	id_t dir_id = 0;
+	id_t bucket_id = 0;
+	int err = 0;
+	char* root = new_page(trans_id,root_id,err);
+	if (!root)
+		return err;
+
+	char* dir = new_page(trans_id,dir_id,err);
+	if (!dir)
+		return err;
+
+	if (!new_page(trans_id,bucket_id,err))
+		return err;
+
+	RootHeader* header = reinterpret_cast<RootHeader*>(root);
+	header->m_magic = s_magic;
+	header->m_global_depth = 0;
+	header->m_dir_page_count = 1;
+	dir_pages(root)[0] = dir_id;
+
+	reinterpret_cast<id_t*>(dir)[0] = bucket_id;
+
+	m_root = root_id;
+	m_dir_dirty = true;
+	return 0;
+}
+
+OOKv::id_t HashIndex::find_bucket(const id_t& trans_id, uint64_t hash, int& err)
+{
+	// Use the cache unless our own write transaction has changed the directory
+	if (!m_dir_dirty || trans_id != m_write_trans_id)
+		return find_bucket_cached(trans_id,hash,err);
+
+	return find_bucket_uncached(trans_id,hash,err);
+}
+
+OOKv::id_t HashIndex::find_bucket_uncached(const id_t& trans_id, uint64_t hash, int& err)
+{
+	BlockStore::Block hold_root;
+	const char* root = read_page(trans_id,m_root,hold_root,err);
+	if (!root)
+		return 0;
+
+	const RootHeader* header = reinterpret_cast<const RootHeader*>(root);
+	if (header->m_magic != s_magic)
+	{
+		err = EINVAL;
+		return 0;
+	}
+
+	size_t per_page = m_block_size / sizeof(id_t);
+	size_t index = static_cast<size_t>(hash & ((uint64_t(1) << header->m_global_depth) - 1));
+
+	BlockStore::Block hold_dir;
+	const char* dir = read_page(trans_id,dir_pages(root)[index / per_page],hold_dir,err);
+	if (!dir)
+		return 0;
+
+	return reinterpret_cast<const id_t*>(dir)[index % per_page];
+}
+
+OOKv::id_t HashIndex::find_bucket_cached(const id_t& trans_id, uint64_t hash, int& err)
+{
+	// A write transaction sees the last committed directory until it changes it
+	id_t snapshot = (trans_id == m_write_trans_id ? trans_id - 1 : trans_id);
+
+	size_t per_page = m_block_size / sizeof(id_t);
+	size_t index = 0;
+	id_t page_id = 0;
+	BlockStore::Block dir;
+
+	err = 0;
+	for (bool loaded = false;;)
+	{
+		OOBase::ReadGuard<OOBase::RWMutex> guard(m_dir_lock);
+
+		DirSnapshot** d = m_dirs.find(snapshot);
+		if (d)
+		{
+			index = static_cast<size_t>(hash & ((uint64_t(1) << (*d)->m_depth) - 1));
+			page_id = *(*d)->m_page_ids.at(index / per_page);
+			dir = *(*d)->m_pages.at(index / per_page);
+			break;
+		}
+
+		guard.release();
+
+		// Another snapshot may have pushed it out again, so just read it this time
+		if (loaded)
+			return find_bucket_uncached(snapshot,hash,err);
+
+		if ((err = load_directory(snapshot)) != 0)
+			return 0;
+
+		loaded = true;
+	}
+
+	if (!dir)
+	{
+		dir = m_store->get_block(page_id,snapshot,err);
+		if (err != 0)
+			return 0;
+
+		// Keep it for the next lookup
+		OOBase::Guard<OOBase::RWMutex> guard(m_dir_lock);
+
+		DirSnapshot** d = m_dirs.find(snapshot);
+		if (d && !*(*d)->m_pages.at(index / per_page))
+			*(*d)->m_pages.at(index / per_page) = dir;
+	}
+
+	return static_cast<const id_t*>(static_cast<const void*>(dir))[index % per_page];
+}
+
+int HashIndex::load_directory(const id_t& snapshot)
+{
+	// Read the root outside the lock
+	int err = 0;
+	BlockStore::Block hold = m_store->get_block(m_root,snapshot,err);
+	if (err != 0)
+		return err;
+
+	const char* root = data(hold);
+	const RootHeader* header = reinterpret_cast<const RootHeader*>(root);
+	if (header->m_magic != s_magic)
+		return EINVAL;
+
+	DirSnapshot* dir = new (std::nothrow) DirSnapshot();
+	if (!dir)
+		return ERROR_OUTOFMEMORY;
+
+	dir->m_depth = header->m_global_depth;
+	for (uint32_t p = 0; err == 0 && p < header->m_dir_page_count; ++p)
+		err = dir->m_page_ids.push_back(dir_pages(root)[p]);
+
+	if (err == 0)
+		err = dir->m_pages.resize(header->m_dir_page_count);
+
+	OOBase::Guard<OOBase::RWMutex> guard(m_dir_lock);
+
+	// Another thread may have beaten us to it
+	if (err != 0 || m_dirs.exists(snapshot))
+	{
+		delete dir;
+		return err;
+	}
+
+	// Make room by dropping the oldest snapshot
+	if (m_dirs.size() >= s_dir_snapshots)
+	{
+		delete *m_dirs.at(0);
+		m_dirs.remove_at(0);
+	}
+
+	if ((err = m_dirs.insert(snapshot,dir)) != 0)
+		delete dir;
+
+	return err;
+}
+
+bool HashIndex::find(const id_t& trans_id, uint64_t key, uint64_t& value, int& err)
+{
+	id_t bucket_id = find_bucket(trans_id,hash(key),err);
+	if (err != 0)
+		return false;
+
+	BlockStore::Block hold;
+	const char* bucket = read_page(trans_id,bucket_id,hold,err);
+	if (!bucket)
+		return false;
+
+	const Entry* e = entries(bucket);
+	for (uint32_t i = reinterpret_cast<const BucketHeader*>(bucket)->m_count; i--; ++e)
+	{
+		if (e->m_key == key)
+		{
+			value = e->m_value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int HashIndex::insert(const id_t& trans_id, uint64_t key, uint64_t value)
+{
+	int err = begin_write(trans_id);
+	if (err != 0)
+		return err;
+
+	uint64_t h = hash(key);
+	size_t capacity = (m_block_size - sizeof(BucketHeader)) / sizeof(Entry);
+	for (;;)
+	{
+		id_t bucket_id = find_bucket(trans_id,h,err);
+		if (err != 0)
+			return err;
+
+		char* bucket = write_page(trans_id,bucket_id,err);
+		if (!bucket)
+			return err;
+
+		BucketHeader* header = reinterpret_cast<BucketHeader*>(bucket);
+		Entry* e = entries(bucket);
+		for (uint32_t i = 0; i < header->m_count; ++i)
+		{
+			if (e[i].m_key == key)
+			{
+				e[i].m_value = value;
+				return 0;
+			}
+		}
+
+		if (header->m_count < capacity)
+		{
+			e[header->m_count].m_key = key;
+			e[header->m_count].m_value = value;
+			++header->m_count;
+			return 0;
+		}
+
+		// Full, split the bucket and try again
+		if ((err = split(trans_id,bucket_id,h)) != 0)
+			return err;
+	}
+}
+
+int HashIndex::remove(const id_t& trans_id, uint64_t key)
+{
+	int err = begin_write(trans_id);
+	if (err != 0)
+		return err;
+
+	id_t bucket_id = find_bucket(trans_id,hash(key),err);
+	if (err != 0)
+		return err;
+
+	// Look before we copy the page
+	BlockStore::Block hold;
+	const char* bucket = read_page(trans_id,bucket_id,hold,err);
+	if (!bucket)
+		return err;
+
+	uint32_t count = reinterpret_cast<const BucketHeader*>(bucket)->m_count;
+	uint32_t i = 0;
+	for (const Entry* e = entries(bucket); i < count && e->m_key != key; ++e)
+		++i;
+
+	if (i == count)
+		return ENOENT;
+
+	char* w = write_page(trans_id,bucket_id,err);
+	if (!w)
+		return err;
+
+	// Move the last entry into the hole
+	BucketHeader* header = reinterpret_cast<BucketHeader*>(w);
+	entries(w)[i] = entries(w)[--header->m_count];
+	return 0;
+}
+
+int HashIndex::set_bucket(const id_t& trans_id, size_t index, const id_t& bucket_id)
+{
+	BlockStore::Block hold;
+	int err = 0;
+	const char* root = read_page(trans_id,m_root,hold,err);
+	if (!root)
+		return err;
+
+	size_t per_page = m_block_size / sizeof(id_t);
+	char* dir = write_page(trans_id,dir_pages(root)[index / per_page],err);
+	if (!dir)
+		return err;
+
+	reinterpret_cast<id_t*>(dir)[index % per_page] = bucket_id;
+	m_dir_dirty = true;
+	return 0;
+}
+
+int HashIndex::grow_directory(const id_t& trans_id)
+{
+	int err = 0;
+	char* root = write_page(trans_id,m_root,err);
+	if (!root)
+		return err;
+
+	m_dir_dirty = true;
+
+	RootHeader* header = reinterpret_cast<RootHeader*>(root);
+	size_t per_page = m_block_size / sizeof(id_t);
+	size_t max_pages = (m_block_size - sizeof(RootHeader)) / sizeof(id_t);
+	size_t size = size_t(1) << header->m_global_depth;
+
+	// Double the directory, the new half is a copy of the old
+	if (size * 2 <= per_page)
+	{
+		char* dir = write_page(trans_id,dir_pages(root)[0],err);
+		if (!dir)
+			return err;
+
+		memcpy(dir + size * sizeof(id_t),dir,size * sizeof(id_t));
+	}
+	else
+	{
+		size_t pages = header->m_dir_page_count;
+		if (pages * 2 > max_pages || header->m_global_depth >= 8 * sizeof(size_t) - 2)
+			return ENOSPC;
+
+		for (size_t p = 0; p < pages; ++p)
+		{
+			BlockStore::Block hold;
+			const char* src = read_page(trans_id,dir_pages(root)[p],hold,err);
+			if (!src)
+				return err;
+
+			id_t dir_id = 0;
+			char* dir = new_page(trans_id,dir_id,err);
+			if (!dir)
+				return err;
+
+			memcpy(dir,src,m_block_size);
+			dir_pages(root)[pages + p] = dir_id;
+		}
+
+		header->m_dir_page_count = static_cast<uint32_t>(pages * 2);
+	}
+
+	++header->m_global_depth;
+	return 0;
+}
+
+int HashIndex::split(const id_t& trans_id, const id_t& bucket_id, uint64_t hash_val)
+{
+	int err = 0;
+	char* bucket = write_page(trans_id,bucket_id,err);
+	if (!bucket)
+		return err;
+
+	BucketHeader* header = reinterpret_cast<BucketHeader*>(bucket);
+
+	BlockStore::Block hold;
+	const char* root = read_page(trans_id,m_root,hold,err);
+	if (!root)
+		return err;
+
+	if (header->m_local_depth == reinterpret_cast<const RootHeader*>(root)->m_global_depth && (err = grow_directory(trans_id)) != 0)
+		return err;
+
+	// Page data does not move when m_dirty grows, so bucket is still good
+	id_t new_id = 0;
+	char* new_bucket = new_page(trans_id,new_id,err);
+	if (!new_bucket)
+		return err;
+
+	uint32_t depth = header->m_local_depth;
+	uint64_t bit = uint64_t(1) << depth;
+
+	// Move the entries with the new bit set
+	BucketHeader* new_header = reinterpret_cast<BucketHeader*>(new_bucket);
+	Entry* e = entries(bucket);
+	Entry* n = entries(new_bucket);
+	for (uint32_t i = 0; i < header->m_count;)
+	{
+		if (hash(e[i].m_key) & bit)
+		{
+			n[new_header->m_count++] = e[i];
+			e[i] = e[--header->m_count];
+		}
+		else
+			++i;
+	}
+
+	header->m_local_depth = new_header->m_local_depth = depth + 1;
+
+	// Point the directory entries with the new bit set at the new bucket
+	const char* root_now = read_page(trans_id,m_root,hold,err);
+	if (!root_now)
+		return err;
+
+	size_t size = size_t(1) << reinterpret_cast<const RootHeader*>(root_now)->m_global_depth;
+	for (size_t i = static_cast<size_t>((hash_val & (bit - 1)) | bit); i < size; i += static_cast<size_t>(bit << 1))
+	{
+		if ((err = set_bucket(trans_id,i,new_id)) != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+int HashIndex::flush(const id_t& trans_id)
+{
+	if (trans_id != m_write_trans_id)
+		return (m_dirty.empty() ? 0 : EINVAL);
+
+	int err = 0;
+	for (size_t i = 0; err == 0 && i < m_dirty.size(); ++i)
+	{
+		const id_t& block_id = *m_dirty.key_at(i);
+		Page* page = m_dirty.at(i);
+
+		// New pages are logged whole, existing ones as a diff
+		if (page->m_new)
+			err = m_store->write_extent(block_id,trans_id,0,data(page->m_block),m_block_size);
+		else
+			err = m_store->update_block(block_id,trans_id,page->m_block);
+	}
+
+	if (err == 0)
+		discard();
+
+	return err;
+}
@@ -0,0 +1,169 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "LogBuffer.h"
+
+using namespace OOKv;
+
+LogBuffer::LogBuffer() :
+		m_head(NULL),
+		m_tail(NULL),
+		m_free(NULL),
+		m_free_count(0),
+		m_length(0),
+		m_last_error(0)
+{
+}
+
+LogBuffer::~LogBuffer()
+{
+	reset();
+
+	while (m_free)
+	{
+		Chunk* next = m_free->m_next;
+		OOBase::HeapAllocator::free(m_free);
+		m_free = next;
+	}
+}
+
+void LogBuffer::reset()
+{
+	// Return the chunks to the free list, keeping a few spares around
+	while (m_head)
+	{
+		Chunk* next = m_head->m_next;
+		if (m_free_count < s_spare_chunks)
+		{
+			m_head->m_next = m_free;
+			m_free = m_head;
+			++m_free_count;
+		}
+		else
+			OOBase::HeapAllocator::free(m_head);
+
+		m_head = next;
+	}
+
+	m_tail = NULL;
+	m_length = 0;
+	m_last_error = 0;
+	m_segments.clear();
+}
+
+LogBuffer::Chunk* LogBuffer::new_chunk()
+{
+	Chunk* chunk = m_free;
+	if (chunk)
+	{
+		m_free = chunk->m_next;
+		--m_free_count;
+	}
+	else
+	{
+		chunk = static_cast<Chunk*>(OOBase::HeapAllocator::allocate(sizeof(Chunk)));
+		if (!chunk)
+		{
+			m_last_error = ERROR_OUTOFMEMORY;
+			return NULL;
+		}
+	}
+
+	chunk->m_next = NULL;
+	chunk->m_used = 0;
+
+	if (m_tail)
+		m_tail->m_next = chunk;
+	else
+		m_head = chunk;
+	m_tail = chunk;
+
+	return chunk;
+}
+
+char* LogBuffer::append(size_t length)
+{
+	// Returns length contiguous bytes in the current chunk, length <= s_chunk_size
+	if (!m_tail || s_chunk_size - m_tail->m_used < length)
+	{
+		if (!new_chunk())
+			return NULL;
+	}
+
+	char* ptr = m_tail->m_data + m_tail->m_used;
+
+	// Extend the last segment if it ends where we start, otherwise start a new one
+	File::IOBuffer* last = m_segments.empty() ? NULL : m_segments.at(m_segments.size()-1);
+	if (last && static_cast<const char*>(last->m_data) + last->m_length == ptr)
+		last->m_length += length;
+	else
+	{
+		File::IOBuffer seg = { ptr, length };
+		if ((m_last_error = m_segments.push_back(seg)) != 0)
+			return NULL;
+	}
+
+	m_tail->m_used += length;
+	m_length += length;
+
+	return ptr;
+}
+
+bool LogBuffer::write(const void* data, size_t length)
+{
+	const char* src = static_cast<const char*>(data);
+	while (length)
+	{
+		size_t len = length;
+		if (m_tail && m_tail->m_used < s_chunk_size && s_chunk_size - m_tail->m_used < len)
+			len = s_chunk_size - m_tail->m_used;
+		else if (len > s_chunk_size)
+			len = s_chunk_size;
+
+		char* ptr = append(len);
+		if (!ptr)
+			return false;
+
+		memcpy(ptr,src,len);
+		src += len;
+		length -= len;
+	}
+
+	return true;
+}
+
+bool LogBuffer::write_ref(const void* data, size_t length)
+{
+	if (length < s_ref_threshold)
+		return write(data,length);
+
+	File::IOBuffer seg = { data, length };
+	if ((m_last_error = m_segments.push_back(seg)) != 0)
+		return false;
+
+	m_length += length;
+	return true;
+}
+
+void* LogBuffer::reserve(size_t length)
+{
+	return append(length);
+}
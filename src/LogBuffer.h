@@ -0,0 +1,107 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_LOGBUFFER_H_INCLUDED_
+#define OOKV_LOGBUFFER_H_INCLUDED_
+
+#include "File.h"
+
+#include <OOBase/Vector.h>
+
+namespace OOKv
+{
+	// An append-only transaction log built from fixed size chunks.
+	// Chunks are kept across reset() so steady state commits do not allocate,
+	// and the log is written to the journal with a single gathered write.
+	class LogBuffer
+	{
+	public:
+		static const size_t s_chunk_size = 64 * 1024;
+		static const size_t s_spare_chunks = 16;
+
+		// Runs at least this long are referenced rather than copied
+		static const size_t s_ref_threshold = 256;
+
+		LogBuffer();
+		~LogBuffer();
+
+		void reset();
+
+		bool write(const void* data, size_t length);
+
+		template <typename T>
+		bool write(T val)
+		{
+			return write(&val,sizeof(T));
+		}
+
+		// Append data without copying it, the caller must keep it alive until reset()
+		bool write_ref(const void* data, size_t length);
+
+		// Reserve space for a value that is filled in later, the pointer is stable until reset()
+		void* reserve(size_t length);
+
+		uint64_t length() const
+		{
+			return m_length;
+		}
+
+		int last_error() const
+		{
+			return m_last_error;
+		}
+
+		// The log as a list of buffers for File::writev()
+		const File::IOBuffer* buffers() const
+		{
+			return m_segments.empty() ? NULL : m_segments.at(0);
+		}
+
+		size_t buffer_count() const
+		{
+			return m_segments.size();
+		}
+
+	private:
+		LogBuffer(const LogBuffer&);
+		LogBuffer& operator = (const LogBuffer&);
+
+		struct Chunk
+		{
+			Chunk* m_next;
+			size_t m_used;
+			char   m_data[s_chunk_size];
+		};
+
+		Chunk*                         m_head;
+		Chunk*                         m_tail;
+		Chunk*                         m_free;
+		size_t                         m_free_count;
+		uint64_t                       m_length;
+		int                            m_last_error;
+		OOBase::Vector<File::IOBuffer> m_segments;
+
+		char* append(size_t length);
+		Chunk* new_chunk();
+	};
+}
+
+#endif // OOKV_LOGBUFFER_H_INCLUDED_
@@ -0,0 +1,121 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "Numa.h"
+#include "Sharding.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_SCHED_GETCPU)
+#include <sched.h>
+#endif
+
+using namespace OOKv;
+
+NumaTopology::NumaTopology() :
+		m_nodes(1),
+		m_simulated(false)
+{
+	memset(m_cpu_node,0,sizeof(m_cpu_node));
+}
+
+void NumaTopology::init()
+{
+	m_nodes = 1;
+	m_simulated = false;
+	memset(m_cpu_node,0,sizeof(m_cpu_node));
+
+	const char* sim = getenv("OOKV_NUMA_NODES");
+	if (sim)
+	{
+		long n = strtol(sim,NULL,10);
+		if (n > 0)
+		{
+			m_nodes = (static_cast<size_t>(n) > s_max_nodes ? s_max_nodes : static_cast<size_t>(n));
+			m_simulated = true;
+			return;
+		}
+	}
+
+#if defined(__linux__)
+	// Each node lists its cpus in sysfs, stop at the first missing node
+	size_t nodes = 0;
+	while (nodes < s_max_nodes && read_cpulist(nodes))
+		++nodes;
+
+	if (nodes)
+		m_nodes = nodes;
+#endif
+}
+
+bool NumaTopology::read_cpulist(size_t node)
+{
+	char path[64];
+	snprintf(path,sizeof(path),"/sys/devices/system/node/node%u/cpulist",static_cast<unsigned int>(node));
+
+	FILE* f = fopen(path,"r");
+	if (!f)
+		return false;
+
+	// A list of ranges, e.g. "0-3,8-11"
+	char buf[1024] = {0};
+	bool ok = (fgets(buf,sizeof(buf),f) != NULL);
+	fclose(f);
+
+	for (char* p = buf; ok && *p >= '0' && *p <= '9';)
+	{
+		unsigned long first = strtoul(p,&p,10);
+		unsigned long last = first;
+		if (*p == '-')
+			last = strtoul(p+1,&p,10);
+
+		for (unsigned long cpu = first; cpu <= last && cpu < s_max_cpus; ++cpu)
+			m_cpu_node[cpu] = static_cast<unsigned char>(node);
+
+		if (*p == ',')
+			++p;
+	}
+
+	return ok;
+}
+
+size_t NumaTopology::current_node() const
+{
+	if (m_nodes == 1)
+		return 0;
+
+#if defined(HAVE_SCHED_GETCPU)
+	int cpu = sched_getcpu();
+	if (cpu >= 0)
+	{
+		if (m_simulated)
+			return static_cast<size_t>(cpu) % m_nodes;
+
+		if (static_cast<size_t>(cpu) < s_max_cpus)
+			return m_cpu_node[cpu];
+	}
+#endif
+
+	// Without a cpu number, give each thread a stable node
+	return thread_hint() % m_nodes;
+}
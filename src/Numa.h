@@ -0,0 +1,58 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_NUMA_H_INCLUDED_
+#define OOKV_NUMA_H_INCLUDED_
+
+#include "config-kv.h"
+
+namespace OOKv
+{
+	// Which NUMA node the calling thread is running on.
+	// Setting OOKV_NUMA_NODES=n in the environment simulates n nodes, spreading
+	// the cpus round robin, so the NUMA paths can be exercised on a single node.
+	class NumaTopology
+	{
+	public:
+		static const size_t s_max_nodes = 8;
+		static const size_t s_max_cpus = 1024;
+
+		NumaTopology();
+
+		void init();
+
+		size_t node_count() const
+		{
+			return m_nodes;
+		}
+
+		size_t current_node() const;
+
+	private:
+		size_t        m_nodes;
+		bool          m_simulated;
+		unsigned char m_cpu_node[s_max_cpus];
+
+		bool read_cpulist(size_t node);
+	};
+}
+
+#endif // OOKV_NUMA_H_INCLUDED_
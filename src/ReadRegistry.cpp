@@ -0,0 +1,230 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "ReadRegistry.h"
+
+#include <OOBase/Atomic.h>
+
+#if defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#include <signal.h>
+#endif
+
+using namespace OOKv;
+
+namespace
+{
+	// A CAS that never changes the value gives us a full barrier load
+	id_t atomic_load(volatile id_t& val)
+	{
+		return OOBase::Atomic<id_t>::CompareAndSwap(val,0,0);
+	}
+}
+
+uint64_t OOKv::current_pid()
+{
+#if defined(HAVE_UNISTD_H)
+	return static_cast<uint64_t>(getpid());
+#else
+	return 1;
+#endif
+}
+
+bool OOKv::process_alive(const uint64_t& pid)
+{
+#if defined(HAVE_UNISTD_H)
+	return (kill(static_cast<pid_t>(pid),0) == 0 || errno != ESRCH);
+#else
+	// Without a way to ask, only timeouts can recover from a dead process
+	return true;
+#endif
+}
+
+ReadRegistry::ReadRegistry() :
+		m_slots(NULL),
+		m_count(0),
+		m_pid(current_pid()),
+		m_allocation(NULL),
+		m_overflow_allowed(false)
+{
+}
+
+ReadRegistry::~ReadRegistry()
+{
+	OOBase::HeapAllocator::free(m_allocation);
+}
+
+int ReadRegistry::init(size_t count)
+{
+	// Over-allocate so the slots can start on a cache line
+	void* allocation = OOBase::HeapAllocator::allocate((count + 1) * sizeof(Slot));
+	if (!allocation)
+		return ERROR_OUTOFMEMORY;
+
+	Slot* slots = static_cast<Slot*>(cache_align(allocation));
+	memset(slots,0,count * sizeof(Slot));
+
+	attach(slots,count,true);
+	m_allocation = allocation;
+
+	return 0;
+}
+
+void ReadRegistry::attach(Slot* slots, size_t count, bool overflow)
+{
+	OOBase::HeapAllocator::free(m_allocation);
+	m_allocation = NULL;
+
+	m_slots = slots;
+	m_count = count;
+	m_overflow_allowed = overflow;
+}
+
+size_t ReadRegistry::hint() const
+{
+	return thread_hint() % m_count;
+}
+
+OOKv::id_t ReadRegistry::acquire(const volatile id_t& last_transaction, int& err)
+{
+	if (!m_count)
+	{
+		err = EINVAL;
+		return 0;
+	}
+
+	// An empty store has no snapshot to protect
+	id_t trans_id = last_transaction;
+	if (trans_id == 0)
+	{
+		err = 0;
+		return 0;
+	}
+
+	size_t start = hint();
+	for (size_t i = 0; i < m_count; ++i)
+	{
+		Slot& slot = m_slots[(start + i) % m_count];
+		if (slot.m_trans_id == 0 && OOBase::Atomic<id_t>::CompareAndSwap(slot.m_trans_id,0,trans_id) == 0)
+		{
+			OOBase::Atomic<uint64_t>::Exchange(slot.m_owner_pid,m_pid);
+
+			// A checkpoint may have scanned the table between our read of
+			// last_transaction and the CAS, so move forward until they agree
+			for (id_t latest = last_transaction; latest != trans_id; latest = last_transaction)
+			{
+				OOBase::Atomic<id_t>::Exchange(slot.m_trans_id,latest);
+				trans_id = latest;
+			}
+
+			err = 0;
+			return trans_id;
+		}
+	}
+
+	// Every slot is in use
+	if (!m_overflow_allowed)
+	{
+		err = EAGAIN;
+		return 0;
+	}
+
+	// Read last_transaction under the lock, so oldest() either sees our entry
+	// or started before we read it
+	OOBase::Guard<OOBase::SpinLock> guard(m_overflow_lock);
+
+	trans_id = last_transaction;
+	err = m_overflow.push_back(trans_id);
+	return (err == 0 ? trans_id : 0);
+}
+
+int ReadRegistry::release(const id_t& trans_id)
+{
+	if (trans_id == 0)
+		return 0;
+
+	size_t start = hint();
+	for (size_t i = 0; i < m_count; ++i)
+	{
+		// Another process may hold the same snapshot
+		Slot& slot = m_slots[(start + i) % m_count];
+		if (slot.m_trans_id == trans_id && slot.m_owner_pid == m_pid &&
+				OOBase::Atomic<uint64_t>::CompareAndSwap(slot.m_owner_pid,m_pid,0) == m_pid)
+		{
+			OOBase::Atomic<id_t>::Exchange(slot.m_trans_id,0);
+			return 0;
+		}
+	}
+
+	if (m_overflow_allowed)
+	{
+		OOBase::Guard<OOBase::SpinLock> guard(m_overflow_lock);
+
+		for (size_t i = 0; i < m_overflow.size(); ++i)
+		{
+			if (*m_overflow.at(i) == trans_id)
+			{
+				m_overflow.remove_at(i);
+				return 0;
+			}
+		}
+	}
+
+	return ENOENT;
+}
+
+OOKv::id_t ReadRegistry::oldest(const volatile id_t& last_transaction) const
+{
+	id_t earliest = last_transaction;
+	for (size_t i = 0; i < m_count; ++i)
+	{
+		Slot& slot = m_slots[i];
+		id_t trans_id = atomic_load(slot.m_trans_id);
+		if (trans_id == 0)
+			continue;
+
+		// A reader that died with a transaction open would pin checkpoints forever.
+		// Taking the pid first stops anyone else reclaiming the slot at the same time.
+		uint64_t pid = OOBase::Atomic<uint64_t>::CompareAndSwap(slot.m_owner_pid,0,0);
+		if (pid && pid != m_pid && !process_alive(pid) &&
+				OOBase::Atomic<uint64_t>::CompareAndSwap(slot.m_owner_pid,pid,0) == pid)
+		{
+			OOBase::Atomic<id_t>::CompareAndSwap(slot.m_trans_id,trans_id,0);
+			continue;
+		}
+
+		if (trans_id < earliest)
+			earliest = trans_id;
+	}
+
+	if (m_overflow_allowed)
+	{
+		OOBase::Guard<OOBase::SpinLock> guard(m_overflow_lock);
+
+		for (size_t i = 0; i < m_overflow.size(); ++i)
+		{
+			if (*m_overflow.at(i) < earliest)
+				earliest = *m_overflow.at(i);
+		}
+	}
+
+	return earliest;
+}
@@ -0,0 +1,97 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_READREGISTRY_H_INCLUDED_
+#define OOKV_READREGISTRY_H_INCLUDED_
+
+#include "config-kv.h"
+
+#include "../include/BlockStore.h"
+#include "Sharding.h"
+
+#include <OOBase/Mutex.h>
+#include <OOBase/Vector.h>
+
+namespace OOKv
+{
+	// The pid of this process, and whether the process pid is still running
+	uint64_t current_pid();
+	bool process_alive(const uint64_t& pid);
+
+	// A fixed table of reader slots, each holding the trans_id of an open
+	// read transaction or 0 if free, and the pid of the process that holds it.
+	// Readers claim and clear slots with a few atomic operations, and never
+	// touch a lock.  Slots left by a process that died are reclaimed by oldest().
+	// If every slot is taken, readers fall back to a locked overflow list.
+	class ReadRegistry
+	{
+	public:
+		// One slot per cache line, so readers do not false-share.
+		// m_owner_pid is 0 while a slot is being claimed or released.
+		struct Slot
+		{
+			volatile id_t     m_trans_id;
+			volatile uint64_t m_owner_pid;
+			char              m_pad[s_cache_line - sizeof(id_t) - sizeof(uint64_t)];
+		};
+
+		static const size_t s_default_slots = 126;
+
+		ReadRegistry();
+		~ReadRegistry();
+
+		// Allocate and own count slots
+		int init(size_t count = s_default_slots);
+
+		// Use count slots stored elsewhere, e.g. in a shared mapping.
+		// The overflow list is private to this process, so only allow it
+		// where this process is the one that calls oldest().
+		void attach(Slot* slots, size_t count, bool overflow);
+
+		// Publish a snapshot of last_transaction in a free slot
+		id_t acquire(const volatile id_t& last_transaction, int& err);
+
+		// Clear a slot holding trans_id
+		int release(const id_t& trans_id);
+
+		// Return the earliest published snapshot, or last_transaction if there are none.
+		// Slots held by processes that have died are cleared first.
+		id_t oldest(const volatile id_t& last_transaction) const;
+
+	private:
+		ReadRegistry(const ReadRegistry&);
+		ReadRegistry& operator = (const ReadRegistry&);
+
+		Slot*    m_slots;
+		size_t   m_count;
+		uint64_t m_pid;
+		void*    m_allocation;
+		bool     m_overflow_allowed;
+
+		// Controlled by m_overflow_lock
+		mutable OOBase::SpinLock m_overflow_lock;
+		OOBase::Vector<id_t>     m_overflow;
+
+		size_t hint() const;
+	};
+}
+
+#endif // OOKV_READREGISTRY_H_INCLUDED_
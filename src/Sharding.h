@@ -0,0 +1,48 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef OOKV_SHARDING_H_INCLUDED_
+#define OOKV_SHARDING_H_INCLUDED_
+
+#include "config-kv.h"
+
+namespace OOKv
+{
+	// Data written by different threads is kept at least this far apart, so they do not false-share
+	static const size_t s_cache_line = 64;
+
+	// Round p up to the start of the next cache line
+	inline void* cache_align(void* p)
+	{
+		return reinterpret_cast<void*>((reinterpret_cast<size_t>(p) + s_cache_line - 1) & ~(s_cache_line - 1));
+	}
+
+	// A stable value per thread for spreading threads across shards, without any TLS lookup.
+	// Thread stacks are far apart, so the page holding a local differs from thread to thread.
+	inline size_t thread_hint()
+	{
+		int local = 0;
+		return (reinterpret_cast<size_t>(&local) >> 12);
+	}
+}
+
+#endif // OOKV_SHARDING_H_INCLUDED_
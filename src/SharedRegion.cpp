@@ -0,0 +1,303 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "SharedRegion.h"
+
+#include <OOBase/Atomic.h>
+#include <OOBase/Thread.h>
+
+#include <stdlib.h>
+
+using namespace OOKv;
+
+namespace
+{
+	const uint64_t s_magic = 0x4B434F4C764B4F4Full; // "OOKvLOCK"
+	const uint32_t s_version = 3;
+
+	enum State
+	{
+		Uninitialised = 0,
+		Initialising,
+		Ready
+	};
+
+	uint64_t atomic_load(volatile uint64_t& val)
+	{
+		return OOBase::Atomic<uint64_t>::CompareAndSwap(val,0,0);
+	}
+
+	size_t hash_slot(const id_t& block_id, size_t count)
+	{
+		return static_cast<size_t>((block_id * 0x9E3779B97F4A7C15ull) >> 32) % count;
+	}
+
+	// Setting OOKV_READER_SLOTS=n in the environment sizes the reader table of a new region
+	size_t configured_readers()
+	{
+		const char* val = getenv("OOKV_READER_SLOTS");
+		if (val)
+		{
+			long n = strtol(val,NULL,10);
+			if (n > 0 && n <= 65536)
+				return static_cast<size_t>(n);
+		}
+
+		return ReadRegistry::s_default_slots;
+	}
+}
+
+SharedRegion::SharedRegion() :
+		m_header(NULL),
+		m_length(0),
+		m_created(false)
+{
+}
+
+SharedRegion::~SharedRegion()
+{
+	close();
+}
+
+int SharedRegion::open(Directory& dir, const char* name, size_t block_size, const uint64_t& generation)
+{
+	int err = 0;
+	if (dir.file_exists(name))
+		m_file = dir.open_file(name,false,err);
+	else
+		m_file = dir.create_file(name,false,err);
+	if (err != 0)
+		return err;
+
+	uint64_t file_len = 0;
+	if ((err = m_file.length(file_len)) != 0)
+		return err;
+
+	// A region for this store keeps the reader table it was created with
+	size_t reader_count = configured_readers();
+	Header existing = {0};
+	if (file_len >= sizeof(Header) && m_file.read_at(0,&existing,sizeof(existing),err) == sizeof(existing) &&
+			existing.m_magic == s_magic && existing.m_version == s_version && existing.m_generation == generation &&
+			existing.m_reader_count)
+	{
+		reader_count = static_cast<size_t>(existing.m_reader_count);
+	}
+
+	const size_t length = sizeof(Header) +
+			reader_count * sizeof(ReadRegistry::Slot) +
+			s_cache_slots * (sizeof(CacheSlot) + block_size);
+
+	// Files only ever grow here, so racing processes all end up with enough
+	if (file_len < length && (err = m_file.truncate(length)) != 0)
+		return err;
+
+	Header* header = static_cast<Header*>(m_file.map(0,length,false,err));
+	if (err != 0)
+		return err;
+
+	// Give an initialiser that has not even recorded its pid this long
+	const OOBase::Timeout wait(1,0);
+	for (;;)
+	{
+		int state = OOBase::Atomic<int>::CompareAndSwap(header->m_state,Ready,Ready);
+		if (state == Ready)
+		{
+			if (header->m_magic == s_magic &&
+					header->m_version == s_version &&
+					header->m_generation == generation &&
+					header->m_block_size == block_size)
+			{
+				// A process configured differently raced us to create it
+				if (header->m_reader_count != reader_count || header->m_cache_count != s_cache_slots)
+				{
+					File::unmap(header,length);
+					return EINVAL;
+				}
+				break;
+			}
+
+			// Left over from another store, e.g. one restored from a backup, so start again
+			if (OOBase::Atomic<int>::CompareAndSwap(header->m_state,Ready,Initialising) == Ready)
+			{
+				initialise(header,length,block_size,reader_count,generation);
+				m_created = true;
+				break;
+			}
+		}
+		else if (state == Uninitialised)
+		{
+			// The first process to map the file fills in the header
+			if (OOBase::Atomic<int>::CompareAndSwap(header->m_state,Uninitialised,Initialising) == Uninitialised)
+			{
+				initialise(header,length,block_size,reader_count,generation);
+				m_created = true;
+				break;
+			}
+		}
+		else
+		{
+			// If the initialiser died, take over from it
+			uint64_t owner = atomic_load(header->m_owner_pid);
+			if (((owner && !process_alive(owner)) || (!owner && wait.has_expired())) &&
+					OOBase::Atomic<uint64_t>::CompareAndSwap(header->m_owner_pid,owner,current_pid()) == owner)
+			{
+				initialise(header,length,block_size,reader_count,generation);
+				m_created = true;
+				break;
+			}
+
+			OOBase::Thread::yield();
+		}
+	}
+
+	m_header = header;
+	m_length = length;
+
+	return 0;
+}
+
+void SharedRegion::initialise(Header* header, size_t length, size_t block_size, size_t reader_count, const uint64_t& generation)
+{
+	// We own the region while it is Initialising
+	OOBase::Atomic<uint64_t>::Exchange(header->m_owner_pid,current_pid());
+
+	header->m_magic = s_magic;
+	header->m_version = s_version;
+	header->m_generation = generation;
+	header->m_block_size = block_size;
+	header->m_reader_count = reader_count;
+	header->m_cache_count = s_cache_slots;
+	header->m_last_transaction = 0;
+
+	// Nothing left behind by another store can be trusted
+	memset(header + 1,0,length - sizeof(Header));
+
+	OOBase::Atomic<uint64_t>::Exchange(header->m_owner_pid,0);
+	OOBase::Atomic<int>::Exchange(header->m_state,Ready);
+}
+
+void SharedRegion::close()
+{
+	if (m_header)
+	{
+		File::unmap(m_header,m_length);
+		m_header = NULL;
+		m_length = 0;
+		m_created = false;
+	}
+
+	m_file.close();
+}
+
+void SharedRegion::reset_cache()
+{
+	CacheSlot* slots = cache_slots();
+	for (size_t i = 0; i < m_header->m_cache_count; ++i)
+	{
+		// Take each slot as a writer would, so readers in other processes never see half a reset
+		CacheSlot& slot = slots[i];
+		uint64_t seq;
+		do
+		{
+			seq = atomic_load(slot.m_seq);
+		}
+		while ((seq & 1) || OOBase::Atomic<uint64_t>::CompareAndSwap(slot.m_seq,seq,seq+1) != seq);
+
+		slot.m_block_id = 0;
+		slot.m_start_trans_id = 0;
+
+		OOBase::Atomic<uint64_t>::Exchange(slot.m_seq,seq+2);
+	}
+}
+
+void SharedRegion::publish(const id_t& trans_id)
+{
+	OOBase::Atomic<id_t>::Exchange(m_header->m_last_transaction,trans_id);
+}
+
+void SharedRegion::catch_up(const id_t& trans_id)
+{
+	id_t last = atomic_load(m_header->m_last_transaction);
+	while (last < trans_id)
+	{
+		id_t prev = OOBase::Atomic<id_t>::CompareAndSwap(m_header->m_last_transaction,last,trans_id);
+		if (prev == last)
+			break;
+
+		last = prev;
+	}
+}
+
+ReadRegistry::Slot* SharedRegion::reader_slots() const
+{
+	return reinterpret_cast<ReadRegistry::Slot*>(m_header + 1);
+}
+
+size_t SharedRegion::reader_count() const
+{
+	return static_cast<size_t>(m_header->m_reader_count);
+}
+
+SharedRegion::CacheSlot* SharedRegion::cache_slots() const
+{
+	return reinterpret_cast<CacheSlot*>(reader_slots() + m_header->m_reader_count);
+}
+
+char* SharedRegion::cache_data(size_t slot) const
+{
+	return reinterpret_cast<char*>(cache_slots() + m_header->m_cache_count) + (slot * m_header->m_block_size);
+}
+
+bool SharedRegion::cache_find(const id_t& block_id, const id_t& trans_id, id_t& start_trans_id, void* data) const
+{
+	size_t idx = hash_slot(block_id,s_cache_slots);
+	CacheSlot& slot = cache_slots()[idx];
+
+	// Classic seqlock read: copy the slot, then make sure nobody wrote it meanwhile
+	uint64_t seq = atomic_load(slot.m_seq);
+	if (seq & 1)
+		return false;
+
+	if (slot.m_block_id != block_id || slot.m_start_trans_id == 0 || slot.m_start_trans_id > trans_id)
+		return false;
+
+	start_trans_id = slot.m_start_trans_id;
+	memcpy(data,cache_data(idx),static_cast<size_t>(m_header->m_block_size));
+
+	return (atomic_load(slot.m_seq) == seq);
+}
+
+void SharedRegion::cache_insert(const id_t& block_id, const id_t& start_trans_id, const void* data)
+{
+	size_t idx = hash_slot(block_id,s_cache_slots);
+	CacheSlot& slot = cache_slots()[idx];
+
+	// If another process is writing the slot, just skip it
+	uint64_t seq = slot.m_seq;
+	if ((seq & 1) || OOBase::Atomic<uint64_t>::CompareAndSwap(slot.m_seq,seq,seq+1) != seq)
+		return;
+
+	slot.m_block_id = block_id;
+	slot.m_start_trans_id = start_trans_id;
+	memcpy(cache_data(idx),data,static_cast<size_t>(m_header->m_block_size));
+
+	OOBase::Atomic<uint64_t>::Exchange(slot.m_seq,seq+2);
+}
@@ -0,0 +1,120 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_SHAREDREGION_H_INCLUDED_
+#define OOKV_SHAREDREGION_H_INCLUDED_
+
+#include "File.h"
+#include "ReadRegistry.h"
+
+namespace OOKv
+{
+	// The <store>.lock file, mapped by every process that opens the store.
+	// It holds the last committed transaction, the reader table and a
+	// direct-mapped cache of committed block versions.
+	// The process that creates the region sizes the reader table, from
+	// OOKV_READER_SLOTS in the environment if set.
+	class SharedRegion
+	{
+	public:
+		static const size_t s_cache_slots = 256;
+
+		SharedRegion();
+		~SharedRegion();
+
+		// generation identifies the store, a region left by any other store is reset
+		int open(Directory& dir, const char* name, size_t block_size, const uint64_t& generation);
+		void close();
+
+		bool is_open() const
+		{
+			return (m_header != NULL);
+		}
+
+		const volatile id_t& last_transaction() const
+		{
+			return m_header->m_last_transaction;
+		}
+
+		void publish(const id_t& trans_id);
+
+		// True if open() initialised the region, so no writer had it mapped yet
+		bool created() const
+		{
+			return m_created;
+		}
+
+		// Publish trans_id if it is later, for a reader that created the region
+		// and found transactions in the journal that no writer has published
+		void catch_up(const id_t& trans_id);
+
+		// Forget every cached block, for a writer that cannot trust what it finds
+		void reset_cache();
+
+		ReadRegistry::Slot* reader_slots() const;
+		size_t reader_count() const;
+
+		// Copy the cached version of block_id into data if it is no newer than trans_id
+		bool cache_find(const id_t& block_id, const id_t& trans_id, id_t& start_trans_id, void* data) const;
+
+		// Offer a committed block version to the other processes
+		void cache_insert(const id_t& block_id, const id_t& start_trans_id, const void* data);
+
+	private:
+		SharedRegion(const SharedRegion&);
+		SharedRegion& operator = (const SharedRegion&);
+
+		// Exactly one cache line, so the reader slots that follow it are line aligned
+		struct Header
+		{
+			uint64_t          m_magic;
+			uint32_t          m_version;
+			volatile int      m_state;
+			uint64_t          m_block_size;
+			uint64_t          m_reader_count;
+			uint64_t          m_cache_count;
+			volatile id_t     m_last_transaction;
+			uint64_t          m_generation;
+			volatile uint64_t m_owner_pid;
+		};
+
+		// m_seq is odd while the slot is being written
+		struct CacheSlot
+		{
+			volatile uint64_t m_seq;
+			id_t              m_block_id;
+			id_t              m_start_trans_id;
+			char              m_pad[40];
+		};
+
+		File    m_file;
+		Header* m_header;
+		size_t  m_length;
+		bool    m_created;
+
+		CacheSlot* cache_slots() const;
+		char* cache_data(size_t slot) const;
+
+		static void initialise(Header* header, size_t length, size_t block_size, size_t reader_count, const uint64_t& generation);
+	};
+}
+
+#endif // OOKV_SHAREDREGION_H_INCLUDED_
@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "Stats.h"
+
+#include <OOBase/Atomic.h>
+
+#if !defined(_WIN32)
+#include <time.h>
+#endif
+
+using namespace OOKv;
+
+Stats::Stats()
+{
+	m_shards = static_cast<char*>(cache_align(m_storage));
+	memset(m_storage,0,sizeof(m_storage));
+}
+
+Stats::Shard& Stats::shard()
+{
+	return shard_at(thread_hint() % s_shards);
+}
+
+void Stats::add(Counter counter, counter_t val)
+{
+	OOBase::Atomic<counter_t>::Add(shard().m_counters[counter],val);
+}
+
+void Stats::record(Timer timer, counter_t ns)
+{
+	Histogram& h = shard().m_timers[timer];
+
+	OOBase::Atomic<counter_t>::Increment(h.m_buckets[bucket(ns)]);
+	OOBase::Atomic<counter_t>::Increment(h.m_count);
+	OOBase::Atomic<counter_t>::Add(h.m_total_ns,ns);
+
+	for (counter_t max = h.m_max_ns; ns > max; max = h.m_max_ns)
+	{
+		if (OOBase::Atomic<counter_t>::CompareAndSwap(h.m_max_ns,max,ns) == max)
+			break;
+	}
+}
+
+size_t Stats::bucket(counter_t ns)
+{
+	size_t b = 0;
+	for (counter_t v = ns; v > 1 && b < BlockStore::Latency::s_buckets-1; v >>= 1)
+		++b;
+
+	return b;
+}
+
+void Stats::record(BlockStore::Latency& latency, counter_t ns)
+{
+	++latency.m_buckets[bucket(ns)];
+	++latency.m_count;
+	latency.m_total_ns += ns;
+	if (ns > latency.m_max_ns)
+		latency.m_max_ns = ns;
+}
+
+counter_t Stats::percentile(const BlockStore::Latency& latency, double pct)
+{
+	counter_t target = static_cast<counter_t>(latency.m_count * pct / 100.0);
+	counter_t seen = 0;
+	for (size_t b = 0; b < BlockStore::Latency::s_buckets; ++b)
+	{
+		seen += latency.m_buckets[b];
+		if (seen > target)
+			return (2ull << b);
+	}
+	return latency.m_max_ns;
+}
+
+void Stats::collect(Timer timer, BlockStore::Latency& latency) const
+{
+	memset(&latency,0,sizeof(latency));
+
+	for (size_t s = 0; s < s_shards; ++s)
+	{
+		const Histogram& h = shard_at(s).m_timers[timer];
+
+		latency.m_count += h.m_count;
+		latency.m_total_ns += h.m_total_ns;
+		if (h.m_max_ns > latency.m_max_ns)
+			latency.m_max_ns = h.m_max_ns;
+
+		for (size_t b = 0; b < BlockStore::Latency::s_buckets; ++b)
+			latency.m_buckets[b] += h.m_buckets[b];
+	}
+}
+
+void Stats::collect(BlockStore::Statistics& stats) const
+{
+	counter_t counters[MaxCounter] = {0};
+	for (size_t s = 0; s < s_shards; ++s)
+	{
+		for (size_t c = 0; c < MaxCounter; ++c)
+			counters[c] += shard_at(s).m_counters[c];
+	}
+
+	stats.m_get_block_hits = counters[GetBlockHits];
+	stats.m_get_block_misses = counters[GetBlockMisses];
+	stats.m_shared_cache_hits = counters[SharedCacheHits];
+	stats.m_remote_cache_hits = counters[RemoteCacheHits];
+	stats.m_journal_transactions_replayed = counters[JournalTransactionsReplayed];
+	stats.m_journal_records_replayed = counters[JournalRecordsReplayed];
+	stats.m_commits = counters[Commits];
+	stats.m_commit_bytes = counters[CommitBytes];
+	stats.m_checkpoints = counters[Checkpoints];
+	stats.m_checkpoint_bytes = counters[CheckpointBytes];
+
+	collect(CommitWrite,stats.m_commit_write);
+	collect(CommitSync,stats.m_commit_sync);
+	collect(CommitCheckpoint,stats.m_commit_checkpoint);
+	collect(Checkpoint,stats.m_checkpoint);
+	collect(WriteLockWait,stats.m_write_lock_wait);
+}
+
+counter_t Stats::now_ns()
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq = {0};
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return static_cast<counter_t>(now.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return static_cast<counter_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+#endif
+}
@@ -0,0 +1,119 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_STATS_H_INCLUDED_
+#define OOKV_STATS_H_INCLUDED_
+
+#include "config-kv.h"
+
+#include "../include/BlockStore.h"
+#include "Sharding.h"
+
+namespace OOKv
+{
+	// Counters and latency histograms, striped across cache line aligned
+	// shards so concurrent threads rarely touch the same line.
+	// Updates are single atomic adds, collect() sums the shards.
+	class Stats
+	{
+	public:
+		enum Counter
+		{
+			GetBlockHits = 0,
+			GetBlockMisses,
+			SharedCacheHits,
+			RemoteCacheHits,
+			JournalTransactionsReplayed,
+			JournalRecordsReplayed,
+			Commits,
+			CommitBytes,
+			Checkpoints,
+			CheckpointBytes,
+
+			MaxCounter
+		};
+
+		enum Timer
+		{
+			CommitWrite = 0,
+			CommitSync,
+			CommitCheckpoint,
+			Checkpoint,
+			WriteLockWait,
+
+			MaxTimer
+		};
+
+		Stats();
+
+		void add(Counter counter, counter_t val = 1);
+		void record(Timer timer, counter_t ns);
+
+		void collect(BlockStore::Statistics& stats) const;
+
+		static counter_t now_ns();
+
+		// The power of 2 bucket of a latency histogram that ns falls in
+		static size_t bucket(counter_t ns);
+
+		// Unsynchronised updates to a histogram of one's own, e.g. in a benchmark
+		static void record(BlockStore::Latency& latency, counter_t ns);
+
+		// The upper bound of the bucket holding the pct'th percentile
+		static counter_t percentile(const BlockStore::Latency& latency, double pct);
+
+	private:
+		Stats(const Stats&);
+		Stats& operator = (const Stats&);
+
+		static const size_t s_shards = 16;
+
+		struct Histogram
+		{
+			volatile counter_t m_count;
+			volatile counter_t m_total_ns;
+			volatile counter_t m_max_ns;
+			volatile counter_t m_buckets[BlockStore::Latency::s_buckets];
+		};
+
+		struct Shard
+		{
+			volatile counter_t m_counters[MaxCounter];
+			Histogram          m_timers[MaxTimer];
+		};
+
+		// Each shard starts on its own cache line, in storage aligned by the constructor
+		static const size_t s_shard_size = (sizeof(Shard) + s_cache_line - 1) & ~(s_cache_line - 1);
+
+		char  m_storage[s_shards * s_shard_size + s_cache_line];
+		char* m_shards;
+
+		Shard& shard_at(size_t s) const
+		{
+			return *reinterpret_cast<Shard*>(m_shards + s * s_shard_size);
+		}
+
+		Shard& shard();
+		void collect(Timer timer, BlockStore::Latency& latency) const;
+	};
+}
+
+#endif // OOKV_STATS_H_INCLUDED_
@@ -0,0 +1,78 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifndef OOKV_VARINT_H_INCLUDED_
+#define OOKV_VARINT_H_INCLUDED_
+
+#include "config-kv.h"
+
+namespace OOKv
+{
+	// LEB128: 7 bits per byte, least significant first, top bit set on all but the last
+	namespace Varint
+	{
+		static const size_t s_max_length = 10;
+
+		inline size_t encode(uint64_t val, unsigned char* buf)
+		{
+			size_t len = 0;
+			while (val >= 0x80)
+			{
+				buf[len++] = static_cast<unsigned char>(val | 0x80);
+				val >>= 7;
+			}
+			buf[len++] = static_cast<unsigned char>(val);
+			return len;
+		}
+
+		// Returns the number of bytes consumed, or 0 if buf is truncated, overlong,
+		// or does not fit in 64 bits.  Only what encode() writes is accepted.
+		inline size_t decode(const char* buf, size_t length, uint64_t& val)
+		{
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(buf);
+
+			// Most values are a single byte
+			if (length && p[0] < 0x80)
+			{
+				val = p[0];
+				return 1;
+			}
+
+			val = 0;
+			for (size_t i = 0; i < length && i < s_max_length; ++i)
+			{
+				// The 10th byte only has bit 63 left to give
+				if (i == s_max_length - 1 && p[i] > 1)
+					return 0;
+
+				val |= static_cast<uint64_t>(p[i] & 0x7F) << (7 * i);
+				if (!(p[i] & 0x80))
+				{
+					// A last byte of 0 after others is a padded encoding
+					return (p[i] ? i + 1 : 0);
+				}
+			}
+			return 0;
+		}
+	}
+}
+
+#endif // OOKV_VARINT_H_INCLUDED_
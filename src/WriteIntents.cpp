@@ -0,0 +1,395 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "config-kv.h"
+
+#include "../include/WriteIntents.h"
+
+#include <string.h>
+
+using namespace OOKv;
+
+namespace
+{
+	struct Range
+	{
+		uint64_t m_first;
+		uint64_t m_last;
+	};
+
+	struct Patch
+	{
+		id_t   m_block_id;
+		size_t m_offset;
+		size_t m_length;
+		char*  m_data;
+	};
+
+	inline bool overlaps(uint64_t first1, uint64_t last1, uint64_t first2, uint64_t last2)
+	{
+		return (first1 <= last2 && first2 <= last1);
+	}
+}
+
+struct WriteIntents::Transaction
+{
+	id_t                  m_snapshot;
+	OOBase::Vector<Range> m_ranges;
+	OOBase::Vector<Patch> m_patches;
+};
+
+WriteIntents::WriteIntents(BlockStore* store) :
+		m_store(store),
+		m_block_size(store->block_size())
+{
+	m_store->addref();
+}
+
+WriteIntents::~WriteIntents()
+{
+	while (!m_active.empty())
+		abort(*m_active.at(m_active.size()-1));
+
+	m_store->release();
+}
+
+WriteIntents::Transaction* WriteIntents::begin(int& err)
+{
+	Transaction* trans = new (std::nothrow) Transaction();
+	if (!trans)
+	{
+		err = ERROR_OUTOFMEMORY;
+		return NULL;
+	}
+
+	// Take the snapshot and register it as one step, so release() can't
+	// prune history the snapshot still needs in between
+	OOBase::Guard<OOBase::Mutex> guard(m_lock);
+
+	trans->m_snapshot = m_store->begin_read_transaction(err);
+	if (err != 0)
+	{
+		guard.release();
+		delete trans;
+		return NULL;
+	}
+
+	if ((err = m_active.push_back(trans)) != 0)
+	{
+		guard.release();
+		m_store->end_read_transaction(trans->m_snapshot);
+		delete trans;
+		return NULL;
+	}
+
+	return trans;
+}
+
+const OOKv::id_t& WriteIntents::snapshot(const Transaction* trans) const
+{
+	return trans->m_snapshot;
+}
+
+int WriteIntents::lock_range(Transaction* trans, uint64_t first_key, uint64_t last_key)
+{
+	if (!trans || first_key > last_key)
+		return EINVAL;
+
+	OOBase::Guard<OOBase::Mutex> guard(m_lock);
+
+	for (size_t i = 0; i < m_intents.size(); ++i)
+	{
+		const Intent* intent = m_intents.at(i);
+		if (intent->m_owner != trans && overlaps(first_key,last_key,intent->m_first_key,intent->m_last_key))
+			return EBUSY;
+	}
+
+	Intent intent = { trans, first_key, last_key };
+	int err = m_intents.push_back(intent);
+	if (err == 0)
+	{
+		Range range = { first_key, last_key };
+		if ((err = trans->m_ranges.push_back(range)) != 0)
+			m_intents.pop_back();
+	}
+
+	return err;
+}
+
+int WriteIntents::read(Transaction* trans, const id_t& block_id, size_t offset, void* data, size_t length)
+{
+	if (!trans || offset > m_block_size || length > m_block_size - offset)
+		return EINVAL;
+
+	int err = 0;
+	BlockStore::Block block = m_store->get_block(block_id,trans->m_snapshot,err);
+	if (err != 0)
+		return err;
+
+	memcpy(data,static_cast<const char*>(static_cast<const void*>(block)) + offset,length);
+
+	// Overlay our own changes, in the order they were made
+	for (size_t i = 0; i < trans->m_patches.size(); ++i)
+	{
+		const Patch* p = trans->m_patches.at(i);
+		if (p->m_block_id != block_id || !overlaps(p->m_offset,p->m_offset + p->m_length - 1,offset,offset + length - 1))
+			continue;
+
+		size_t start = (p->m_offset > offset ? p->m_offset : offset);
+		size_t end = (p->m_offset + p->m_length < offset + length ? p->m_offset + p->m_length : offset + length);
+		memcpy(static_cast<char*>(data) + (start - offset),p->m_data + (start - p->m_offset),end - start);
+	}
+
+	return 0;
+}
+
+int WriteIntents::patch(Transaction* trans, const id_t& block_id, size_t offset, const void* data, size_t length)
+{
+	if (!trans || !block_id || !length || offset > m_block_size || length > m_block_size - offset)
+		return EINVAL;
+
+	char* copy = static_cast<char*>(OOBase::HeapAllocator::allocate(length));
+	if (!copy)
+		return ERROR_OUTOFMEMORY;
+
+	memcpy(copy,data,length);
+
+	Patch p = { block_id, offset, length, copy };
+	int err = trans->m_patches.push_back(p);
+	if (err != 0)
+		OOBase::HeapAllocator::free(copy);
+
+	return err;
+}
+
+bool WriteIntents::conflicts(const Transaction* trans)
+{
+	// Caller must hold m_lock
+	for (size_t i = 0; i < m_history.size(); ++i)
+	{
+		const Footprint* f = m_history.at(i);
+		if (f->m_trans_id <= trans->m_snapshot)
+			continue;
+
+		if (!f->m_block_id)
+		{
+			for (size_t j = 0; j < trans->m_ranges.size(); ++j)
+			{
+				const Range* r = trans->m_ranges.at(j);
+				if (overlaps(f->m_first,f->m_last,r->m_first,r->m_last))
+					return true;
+			}
+		}
+		else
+		{
+			for (size_t j = 0; j < trans->m_patches.size(); ++j)
+			{
+				const Patch* p = trans->m_patches.at(j);
+				if (p->m_block_id == f->m_block_id && overlaps(f->m_first,f->m_last,p->m_offset,p->m_offset + p->m_length - 1))
+					return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+int WriteIntents::apply(Transaction* trans, const id_t& trans_id)
+{
+	int err = 0;
+	for (size_t i = 0; err == 0 && i < trans->m_patches.size(); ++i)
+	{
+		const id_t& block_id = trans->m_patches.at(i)->m_block_id;
+
+		// Each block is done once, with all its patches
+		size_t j = 0;
+		while (j < i && trans->m_patches.at(j)->m_block_id != block_id)
+			++j;
+		if (j < i)
+			continue;
+
+		// Patch the latest version, so other transactions' changes to the block survive
+		BlockStore::Block prev = m_store->get_block(block_id,trans_id-1,err);
+		if (err != 0)
+			break;
+
+		// Commits made to the store without us are not in m_history, so check the
+		// bytes we patch are as we saw them.  This catches our own overlaps again too.
+		if (trans_id-1 > trans->m_snapshot)
+		{
+			BlockStore::Block snap = m_store->get_block(block_id,trans->m_snapshot,err);
+			if (err != 0)
+				break;
+
+			for (j = i; err == 0 && j < trans->m_patches.size(); ++j)
+			{
+				const Patch* p = trans->m_patches.at(j);
+				if (p->m_block_id == block_id &&
+						memcmp(static_cast<const char*>(static_cast<const void*>(prev)) + p->m_offset,static_cast<const char*>(static_cast<const void*>(snap)) + p->m_offset,p->m_length) != 0)
+				{
+					err = EAGAIN;
+				}
+			}
+			if (err != 0)
+				break;
+		}
+
+		char* data = static_cast<char*>(OOBase::HeapAllocator::allocate(m_block_size));
+		if (!data)
+		{
+			err = ERROR_OUTOFMEMORY;
+			break;
+		}
+		memcpy(data,static_cast<const void*>(prev),m_block_size);
+
+		for (j = i; j < trans->m_patches.size(); ++j)
+		{
+			const Patch* p = trans->m_patches.at(j);
+			if (p->m_block_id == block_id)
+				memcpy(data + p->m_offset,p->m_data,p->m_length);
+		}
+
+		err = m_store->update_block(block_id,trans_id,BlockStore::Block(data));
+	}
+
+	return err;
+}
+
+int WriteIntents::record(const Transaction* trans, const id_t& trans_id)
+{
+	// Caller must hold m_lock
+	int err = 0;
+	for (size_t i = 0; err == 0 && i < trans->m_ranges.size(); ++i)
+	{
+		const Range* r = trans->m_ranges.at(i);
+		Footprint f = { trans, trans_id, 0, r->m_first, r->m_last };
+		err = m_history.push_back(f);
+	}
+
+	for (size_t i = 0; err == 0 && i < trans->m_patches.size(); ++i)
+	{
+		const Patch* p = trans->m_patches.at(i);
+		Footprint f = { trans, trans_id, p->m_block_id, p->m_offset, p->m_offset + p->m_length - 1 };
+		err = m_history.push_back(f);
+	}
+
+	return err;
+}
+
+int WriteIntents::commit(Transaction* trans)
+{
+	if (!trans)
+		return EINVAL;
+
+	int err = 0;
+	if (!trans->m_patches.empty())
+	{
+		// The store's write transaction serialises commits, so m_lock is only
+		// needed while checking and recording, not while the commit syncs
+		id_t trans_id = m_store->begin_write_transaction(err);
+		if (err == 0)
+		{
+			OOBase::Guard<OOBase::Mutex> guard(m_lock);
+
+			// Record what we touched before committing, so no later conflict can be missed
+			if (conflicts(trans))
+				err = EAGAIN;
+			else
+				err = record(trans,trans_id);
+
+			guard.release();
+
+			if (err == 0)
+				err = apply(trans,trans_id);
+
+			if (err == 0)
+				err = m_store->commit_write_transaction(trans_id);
+			else
+				m_store->rollback_write_transaction(trans_id);
+
+			// The next transaction reuses a failed one's id, and may already have recorded it
+			if (err != 0)
+				forget(trans,trans_id);
+		}
+	}
+
+	abort(trans);
+
+	return err;
+}
+
+void WriteIntents::forget(const Transaction* trans, const id_t& trans_id)
+{
+	OOBase::Guard<OOBase::Mutex> guard(m_lock);
+
+	for (size_t i = m_history.size(); i--;)
+	{
+		const Footprint* f = m_history.at(i);
+		if (f->m_owner == trans && f->m_trans_id == trans_id)
+			m_history.remove_at(i);
+	}
+}
+
+void WriteIntents::abort(Transaction* trans)
+{
+	if (trans)
+	{
+		OOBase::Guard<OOBase::Mutex> guard(m_lock);
+
+		release(trans);
+	}
+}
+
+void WriteIntents::release(Transaction* trans)
+{
+	// Caller must hold m_lock
+	for (size_t i = m_intents.size(); i--;)
+	{
+		if (m_intents.at(i)->m_owner == trans)
+			m_intents.remove_at(i);
+	}
+
+	id_t oldest = 0;
+	for (size_t i = m_active.size(); i--;)
+	{
+		Transaction* t = *m_active.at(i);
+		if (t == trans)
+			m_active.remove_at(i);
+		else if (!oldest || t->m_snapshot < oldest)
+			oldest = t->m_snapshot;
+	}
+
+	// History older than every active snapshot can no longer conflict.  With none
+	// active, all of it is older than any snapshot begin() can take from now on:
+	// a committing transaction stays active until its commit is visible.
+	for (size_t i = m_history.size(); i--;)
+	{
+		if (!oldest || m_history.at(i)->m_trans_id <= oldest)
+			m_history.remove_at(i);
+	}
+
+	for (size_t i = 0; i < trans->m_patches.size(); ++i)
+		OOBase::HeapAllocator::free(trans->m_patches.at(i)->m_data);
+
+	m_store->end_read_transaction(trans->m_snapshot);
+
+	delete trans;
+}
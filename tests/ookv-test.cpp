@@ -0,0 +1,1123 @@
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2011 Rick Taylor
+//
+// This file is part of OOKv, the Omega Online Key/Value library.
+//
+// OOKv is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OOKv is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with OOKv.  If not, see <http://www.gnu.org/licenses/>.
+//
+///////////////////////////////////////////////////////////////////////////////////
+
+
+#include "../src/config-kv.h"
+
+#include "../include/BlockStore.h"
+#include "../include/HashIndex.h"
+#include "../include/BloomFilter.h"
+#include "../include/AsyncBlockStore.h"
+#include "../include/WriteIntents.h"
+
+#include "../src/Varint.h"
+
+#include <OOBase/Thread.h>
+#include <OOBase/Atomic.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+using namespace OOKv;
+
+namespace
+{
+	const char* const s_path = "ookv-test.store";
+	const char* const s_copy_path = "ookv-test.copy";
+	const char* const s_incremental_path = "ookv-test.incr";
+
+	void remove_store(const char* path)
+	{
+		static const char* const suffixes[] = { "", ".journal", ".lock" };
+		for (size_t i = 0; i < sizeof(suffixes)/sizeof(suffixes[0]); ++i)
+		{
+			char name[1024];
+			snprintf(name,sizeof(name),"%s%s",path,suffixes[i]);
+			unlink(name);
+		}
+	}
+
+	BlockStore::Block new_block(size_t block_size, unsigned char value)
+	{
+		void* data = OOBase::HeapAllocator::allocate(block_size);
+		if (data)
+			memset(data,value,block_size);
+		return BlockStore::Block(data);
+	}
+
+	// Commit one transaction that fills block_id with value, allocating the block if block_id is 0
+	int write_value(BlockStore* store, id_t& block_id, unsigned char value)
+	{
+		int err = 0;
+		id_t trans_id = store->begin_write_transaction(err);
+		if (err != 0)
+			return err;
+
+		if (!block_id)
+			block_id = store->alloc_extent(trans_id,1,err);
+
+		if (err == 0)
+		{
+			BlockStore::Block block = new_block(store->block_size(),value);
+			if (!block)
+				err = ERROR_OUTOFMEMORY;
+			else
+				err = store->update_block(block_id,trans_id,block);
+		}
+
+		if (err != 0)
+		{
+			store->rollback_write_transaction(trans_id);
+			return err;
+		}
+
+		return store->commit_write_transaction(trans_id);
+	}
+
+	bool has_value_at(BlockStore* store, const id_t& block_id, const id_t& trans_id, unsigned char value)
+	{
+		int err = 0;
+		BlockStore::Block block = store->get_block(block_id,trans_id,err);
+		if (err != 0)
+			return false;
+
+		const unsigned char* data = static_cast<const unsigned char*>(static_cast<const void*>(block));
+		for (size_t i = 0; i < store->block_size(); ++i)
+		{
+			if (data[i] != value)
+				return false;
+		}
+		return true;
+	}
+
+	bool has_value(BlockStore* store, const id_t& block_id, unsigned char value)
+	{
+		int err = 0;
+		id_t trans_id = store->begin_read_transaction(err);
+		if (err != 0)
+			return false;
+
+		bool ok = has_value_at(store,block_id,trans_id,value);
+		store->end_read_transaction(trans_id);
+		return ok;
+	}
+
+	// Open path and check blocks 1 to count hold values
+	bool check_values(bool read_only, const unsigned char* values, size_t count)
+	{
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,read_only,err);
+		if (!store)
+			return false;
+
+		bool ok = true;
+		for (size_t i = 0; ok && i < count; ++i)
+			ok = has_value(store,i+1,values[i]);
+
+		store->release();
+		return ok;
+	}
+
+	// Varints must round trip at every length, and anything encode() would not write is rejected
+	bool test_varint()
+	{
+		static const uint64_t values[] = { 0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, 0xFFFFFFFFull, 0x7FFFFFFFFFFFFFFFull, 0xFFFFFFFFFFFFFFFFull };
+
+		bool ok = true;
+		for (size_t i = 0; ok && i < sizeof(values)/sizeof(values[0]); ++i)
+		{
+			unsigned char buf[Varint::s_max_length];
+			size_t len = Varint::encode(values[i],buf);
+
+			uint64_t val = 0;
+			ok = (Varint::decode(reinterpret_cast<const char*>(buf),len,val) == len && val == values[i]);
+
+			// Every shorter prefix is truncated
+			for (size_t j = 0; ok && j < len; ++j)
+				ok = (Varint::decode(reinterpret_cast<const char*>(buf),j,val) == 0);
+		}
+
+		uint64_t val = 0;
+
+		// Bits above 63 in the 10th byte
+		ok = ok && Varint::decode("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x02",10,val) == 0;
+
+		// An 11th byte
+		ok = ok && Varint::decode("\x80\x80\x80\x80\x80\x80\x80\x80\x80\x81\x00",11,val) == 0;
+
+		// Padded with a trailing zero byte
+		ok = ok && Varint::decode("\x81\x00",2,val) == 0;
+
+		return ok;
+	}
+
+	// Committed data must survive closing and reopening the store
+	bool test_reopen()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		const unsigned char values[4] = { 0x55, 2, 3, 4 };
+		bool ok = true;
+		for (size_t i = 0; ok && i < 4; ++i)
+		{
+			id_t block_id = 0;
+			ok = (write_value(store,block_id,static_cast<unsigned char>(i+1)) == 0 && block_id == i+1);
+		}
+
+		id_t block_id = 1;
+		ok = ok && write_value(store,block_id,values[0]) == 0;
+
+		store->release();
+
+		return ok && check_values(true,values,4) && check_values(false,values,4);
+	}
+
+	// A writer that dies without a checkpoint leaves its commits in the journal,
+	// perhaps with a torn commit after them, and the next open must replay them
+	bool test_recover()
+	{
+		remove_store(s_path);
+
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			int err = 0;
+			BlockStore* store = BlockStore::open(s_path,false,err);
+			for (size_t i = 0; store && err == 0 && i < 4; ++i)
+			{
+				id_t block_id = 0;
+				if ((err = write_value(store,block_id,static_cast<unsigned char>(i+1))) == 0 && block_id != i+1)
+					err = EINVAL;
+			}
+
+			id_t block_id = 1;
+			if (store && err == 0)
+				err = write_value(store,block_id,0x55);
+
+			// Die without releasing the store, so nothing is checkpointed
+			_exit(!store || err ? 1 : 0);
+		}
+
+		int status = 0;
+		if (pid < 0 || waitpid(pid,&status,0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			return false;
+
+		// Leave half a transaction header on the end of the journal
+		char journal_name[1024];
+		snprintf(journal_name,sizeof(journal_name),"%s.journal",s_path);
+		FILE* f = fopen(journal_name,"ab");
+		if (!f)
+			return false;
+
+		long journal_len = (fseek(f,0,SEEK_END) == 0 ? ftell(f) : -1);
+		static const char torn[12] = { 0 };
+		bool ok = (journal_len > 0 && fwrite(torn,sizeof(torn),1,f) == 1);
+		fclose(f);
+
+		unsigned char values[4] = { 0x55, 2, 3, 4 };
+		if (!ok || !check_values(true,values,4))
+			return false;
+
+		// Or a whole BeginCompact header for transaction 6, whose body has no Commit record
+		if (truncate(journal_name,journal_len) != 0 || (f = fopen(journal_name,"ab")) == NULL)
+			return false;
+
+		const uint64_t header[3] = { 8, 6, 4 };
+		static const char body[4] = { 0 };
+		ok = (fwrite(header,sizeof(header),1,f) == 1 && fwrite(body,sizeof(body),1,f) == 1);
+		fclose(f);
+
+		// Without the shared region, the reader must find the committed end itself
+		char lock_name[1024];
+		snprintf(lock_name,sizeof(lock_name),"%s.lock",s_path);
+		unlink(lock_name);
+
+		if (!ok || !check_values(true,values,4))
+			return false;
+
+		// Mark the journal as version 1, which readers still accept
+		const uint32_t version = 1;
+		int fd = open(journal_name,O_RDWR);
+		ok = (fd != -1 && pwrite(fd,&version,sizeof(version),8) == sizeof(version));
+		if (fd != -1)
+			close(fd);
+
+		if (!ok || !check_values(true,values,4))
+			return false;
+
+		// The writer must replay the journal, cut off the torn tail, and carry on after it
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		// ... and mark the journal as its own version before adding to it
+		uint32_t new_version = 0;
+		fd = open(journal_name,O_RDONLY);
+		ok = (fd != -1 && pread(fd,&new_version,sizeof(new_version),8) == sizeof(new_version) && new_version == 2);
+		if (fd != -1)
+			close(fd);
+
+		id_t block_id = 2;
+		values[1] = 0x66;
+		ok = ok && has_value(store,1,values[0]) && write_value(store,block_id,values[1]) == 0;
+		store->release();
+
+		return ok && check_values(true,values,4) && check_values(false,values,4);
+	}
+
+	// A checkpoint must stop at the oldest reader, and keep what came after it
+	bool test_checkpoint_reader()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		id_t block_id = 0;
+		bool ok = (write_value(store,block_id,1) == 0);
+
+		id_t reader = store->begin_read_transaction(err);
+		ok = ok && err == 0;
+
+		ok = ok && write_value(store,block_id,2) == 0 && write_value(store,block_id,3) == 0;
+		ok = ok && store->checkpoint() == 0;
+		ok = ok && has_value_at(store,block_id,reader,1) && has_value(store,block_id,3);
+
+		if (err == 0)
+			store->end_read_transaction(reader);
+
+		ok = ok && store->checkpoint() == 0 && has_value(store,block_id,3);
+
+		store->release();
+
+		const unsigned char values[1] = { 3 };
+		return ok && check_values(true,values,1);
+	}
+
+	// A reader process that dies with a read transaction open must not pin checkpoints forever
+	bool test_dead_reader()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		id_t block_id = 0;
+		bool ok = (write_value(store,block_id,1) == 0 && store->checkpoint() == 0);
+
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			BlockStore* reader = BlockStore::open(s_path,true,err);
+			if (reader)
+				reader->begin_read_transaction(err);
+
+			_exit(reader && err == 0 ? 0 : 1);
+		}
+
+		int status = 0;
+		ok = ok && pid > 0 && waitpid(pid,&status,0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+		BlockStore::Statistics before = {0};
+		store->get_stats(before);
+
+		ok = ok && write_value(store,block_id,2) == 0 && store->checkpoint() == 0;
+
+		BlockStore::Statistics after = {0};
+		store->get_stats(after);
+		ok = ok && after.m_checkpoints > before.m_checkpoints;
+
+		store->release();
+		return ok;
+	}
+
+	// alloc_block() hands out zeroed blocks, and nothing of a rolled back allocation survives
+	bool test_alloc_block()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		// Filled in and rolled back
+		BlockStore::Block block;
+		id_t trans_id = store->begin_write_transaction(err);
+		id_t block_id = (err == 0 ? store->alloc_block(trans_id,block,err) : 0);
+		bool ok = (err == 0 && block_id == 1 && block);
+		if (ok)
+		{
+			memset(static_cast<void*>(block),0x77,store->block_size());
+			ok = (store->update_block(block_id,trans_id,block) == 0);
+		}
+		store->rollback_write_transaction(trans_id);
+
+		// The same id again, committed without an update
+		trans_id = store->begin_write_transaction(err);
+		block_id = (err == 0 ? store->alloc_block(trans_id,block,err) : 0);
+		ok = ok && err == 0 && block_id == 1;
+		ok = (store->commit_write_transaction(trans_id) == 0 && ok);
+		ok = ok && has_value(store,block_id,0);
+
+		store->release();
+		return ok;
+	}
+
+	int free_value(BlockStore* store, const id_t& block_id)
+	{
+		int err = 0;
+		id_t trans_id = store->begin_write_transaction(err);
+		if (err != 0)
+			return err;
+
+		if ((err = store->free_block(block_id,trans_id)) != 0)
+		{
+			store->rollback_write_transaction(trans_id);
+			return err;
+		}
+
+		return store->commit_write_transaction(trans_id);
+	}
+
+	struct Move
+	{
+		id_t m_from;
+		id_t m_to;
+	};
+
+	int record_move(void* param, const id_t&, const id_t& from_block_id, const id_t& to_block_id)
+	{
+		Move* move = static_cast<Move*>(param);
+		move->m_from = from_block_id;
+		move->m_to = to_block_id;
+		return 0;
+	}
+
+	// Write a full backup of store through a pipe, to show it needs no seeking
+	int backup_to_pipe(BlockStore* store, const char* path, id_t& trans_id)
+	{
+		int fds[2];
+		if (pipe(fds) != 0)
+			return errno;
+
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			close(fds[1]);
+			int out = open(path,O_WRONLY | O_CREAT | O_TRUNC,0644);
+
+			char buf[4096];
+			ssize_t len = 0;
+			while (out >= 0 && (len = read(fds[0],buf,sizeof(buf))) > 0)
+			{
+				if (write(out,buf,len) != len)
+					break;
+			}
+
+			_exit(out < 0 || len != 0 ? 1 : 0);
+		}
+
+		close(fds[0]);
+
+		int err = (pid < 0 ? errno : store->backup(fds[1],0,trans_id));
+		close(fds[1]);
+
+		int status = 0;
+		if (pid > 0 && (waitpid(pid,&status,0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) && err == 0)
+			err = EIO;
+
+		return err;
+	}
+
+	// A full backup plus an incremental restored over it must match the original
+	bool test_backup_restore()
+	{
+		remove_store(s_path);
+		remove_store(s_copy_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		bool ok = true;
+		for (size_t i = 0; ok && i < 3; ++i)
+		{
+			id_t block_id = 0;
+			ok = (write_value(store,block_id,static_cast<unsigned char>(i+1)) == 0);
+		}
+
+		id_t full_trans = 0;
+		ok = ok && backup_to_pipe(store,s_copy_path,full_trans) == 0;
+
+		// Change a block, add one and free one after the full backup
+		id_t block_id = 2;
+		ok = ok && write_value(store,block_id,0x22) == 0;
+
+		block_id = 0;
+		ok = ok && write_value(store,block_id,4) == 0 && block_id == 4;
+		ok = ok && free_value(store,3) == 0;
+
+		id_t incremental_trans = 0;
+		ok = ok && store->backup(s_incremental_path,full_trans,incremental_trans) == 0;
+
+		store->release();
+		if (!ok)
+			return false;
+
+		store = BlockStore::open(s_copy_path,false,err);
+		if (!store)
+			return false;
+
+		id_t trans_id = store->begin_read_transaction(err);
+		ok = (err == 0 && trans_id == full_trans);
+		if (err == 0)
+			store->end_read_transaction(trans_id);
+
+		ok = ok && has_value(store,1,1) && has_value(store,2,2) && has_value(store,3,3);
+
+		// Restoring works once, and only onto the store it started from
+		ok = ok && store->restore(s_incremental_path) == 0 && store->restore(s_incremental_path) == ERANGE;
+
+		trans_id = store->begin_read_transaction(err);
+		ok = ok && err == 0 && trans_id == incremental_trans;
+		if (err == 0)
+			store->end_read_transaction(trans_id);
+
+		ok = ok && has_value(store,1,1) && has_value(store,2,0x22) && has_value(store,4,4);
+
+		// The freed block came across too, so compact() moves the last block into it
+		Move move = { 0, 0 };
+		trans_id = store->begin_write_transaction(err);
+		if (err == 0)
+		{
+			ok = ok && store->compact(trans_id,&record_move,&move) == 0;
+			ok = (store->commit_write_transaction(trans_id) == 0 && ok);
+		}
+		ok = ok && err == 0 && move.m_from == 4 && move.m_to == 3;
+
+		store->release();
+
+		store = BlockStore::open(s_copy_path,true,err);
+		if (!store)
+			return false;
+
+		ok = ok && has_value(store,1,1) && has_value(store,2,0x22) && has_value(store,3,4);
+		store->release();
+
+		return ok;
+	}
+
+	// compact() and update_block() must work from what this transaction has already written,
+	// and nothing a rolled back transaction wrote may be seen afterwards
+	bool test_compact_in_transaction()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		bool ok = true;
+		for (size_t i = 0; ok && i < 3; ++i)
+		{
+			id_t block_id = 0;
+			ok = (write_value(store,block_id,static_cast<unsigned char>(i+1)) == 0);
+		}
+		ok = ok && free_value(store,1) == 0;
+
+		// Update the last block twice, then move it into the free slot
+		BlockStore::Block block = new_block(store->block_size(),0x33);
+
+		Move move = { 0, 0 };
+		id_t trans_id = store->begin_write_transaction(err);
+		if (err == 0)
+		{
+			ok = ok && store->update_block(3,trans_id,new_block(store->block_size(),0x32)) == 0;
+			ok = ok && block && store->update_block(3,trans_id,block) == 0;
+			ok = ok && store->compact(trans_id,&record_move,&move) == 0;
+			ok = (store->commit_write_transaction(trans_id) == 0 && ok);
+		}
+		ok = ok && err == 0 && move.m_from == 3 && move.m_to == 1;
+		ok = ok && has_value(store,1,0x33) && has_value(store,2,2);
+
+		// An update after a partial extent write diffs against the extent,
+		// and blocks allocated in the same transaction can't be moved
+		unsigned char half[8];
+		memset(half,0x34,sizeof(half));
+
+		id_t block_id = 0;
+		trans_id = store->begin_write_transaction(err);
+		if (err == 0)
+		{
+			ok = ok && store->free_block(1,trans_id) == 0;
+			ok = ok && (block_id = store->alloc_extent(trans_id,1,err)) == 3 && err == 0;
+			ok = ok && store->write_extent(block_id,trans_id,0,half,sizeof(half)) == 0;
+			ok = ok && store->update_block(block_id,trans_id,block) == 0;
+			ok = ok && store->compact(trans_id,&record_move,&move) == EBUSY;
+			ok = (store->commit_write_transaction(trans_id) == 0 && ok);
+		}
+		ok = ok && err == 0 && has_value(store,3,0x33);
+
+		// Rolled back updates must not linger in the cache
+		trans_id = store->begin_write_transaction(err);
+		if (err == 0)
+		{
+			ok = ok && store->update_block(2,trans_id,block) == 0;
+			store->rollback_write_transaction(trans_id);
+		}
+		ok = ok && err == 0 && has_value(store,2,2);
+
+		store->release();
+
+		store = BlockStore::open(s_path,true,err);
+		if (!store)
+			return false;
+
+		ok = ok && has_value(store,2,2) && has_value(store,3,0x33);
+		store->release();
+
+		return ok;
+	}
+
+	// A replica must follow the primary's journal across a checkpoint that restarts it,
+	// even once the new journal has grown back past where the replica had read to
+	bool test_replica_restart()
+	{
+		remove_store(s_path);
+		remove_store(s_copy_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		bool ok = true;
+		for (size_t i = 0; ok && i < 2; ++i)
+		{
+			id_t block_id = 0;
+			ok = (write_value(store,block_id,static_cast<unsigned char>(i+1)) == 0);
+		}
+
+		id_t trans_id = 0;
+		ok = ok && store->backup(s_copy_path,0,trans_id) == 0;
+
+		char journal_name[1024];
+		snprintf(journal_name,sizeof(journal_name),"%s.journal",s_path);
+
+		BlockStore* replica = (ok ? BlockStore::open_replica(s_copy_path,journal_name,err) : NULL);
+		if (!replica)
+		{
+			store->release();
+			return false;
+		}
+
+		id_t block_id = 1;
+		id_t last = 0;
+		ok = write_value(store,block_id,0x11) == 0 && write_value(store,block_id,0x12) == 0;
+		ok = ok && replica->replicate(last) == 0 && last == trans_id + 2 && has_value(replica,1,0x12);
+
+		// Restart the journal, and write more than the replica has read
+		ok = ok && store->checkpoint() == 0;
+		for (size_t i = 0; ok && i < 6; ++i)
+		{
+			block_id = 1 + (i % 2);
+			ok = (write_value(store,block_id,static_cast<unsigned char>(0x20 + i)) == 0);
+		}
+
+		ok = ok && replica->replicate(last) == 0 && last == trans_id + 8;
+		ok = ok && has_value(replica,1,0x24) && has_value(replica,2,0x25);
+
+		replica->release();
+		store->release();
+
+		return ok;
+	}
+
+	struct Lookups
+	{
+		HashIndex* m_index;
+		id_t       m_old;
+		id_t       m_new;
+		uint64_t   m_keys;
+		bool       m_ok;
+	};
+
+	int run_lookups(void* param)
+	{
+		Lookups* lookups = static_cast<Lookups*>(param);
+
+		bool ok = true;
+		for (uint64_t k = 0; ok && k < lookups->m_keys; k += 7)
+		{
+			uint64_t value = 0;
+			int err = 0;
+			ok = (lookups->m_index->find(lookups->m_old,lookups->m_keys,value,err) == false && err == 0);
+			ok = ok && lookups->m_index->find(lookups->m_new,lookups->m_keys,value,err) && value == 1;
+			ok = ok && lookups->m_index->find(k % 2 ? lookups->m_old : lookups->m_new,k + 1,value,err) && value == (k + 1) * 3;
+		}
+
+		if (!ok)
+			lookups->m_ok = false;
+		return 0;
+	}
+
+	// Enough keys to split buckets and grow the directory many times,
+	// looked up both from the write transaction and from later readers
+	bool test_hash_index()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		const uint64_t keys = 40000;
+		bool ok = true;
+		id_t root = 0;
+		{
+			HashIndex index(store);
+			id_t trans_id = store->begin_write_transaction(err);
+			ok = (err == 0 && index.create(trans_id) == 0);
+
+			for (uint64_t k = 0; ok && k < keys; ++k)
+				ok = (index.insert(trans_id,k,k * 3) == 0);
+
+			uint64_t value = 0;
+			ok = ok && index.find(trans_id,keys / 2,value,err) && value == keys / 2 * 3;
+			ok = ok && index.remove(trans_id,7) == 0 && index.remove(trans_id,7) == ENOENT;
+			ok = ok && index.flush(trans_id) == 0;
+
+			if (err == 0)
+				ok = (store->commit_write_transaction(trans_id) == 0 && ok);
+			root = index.root();
+		}
+
+		HashIndex index(store,root);
+		id_t reader = store->begin_read_transaction(err);
+		ok = ok && err == 0;
+
+		for (uint64_t k = 0; ok && k < keys; ++k)
+		{
+			uint64_t value = 0;
+			bool found = index.find(reader,k,value,err);
+			ok = (err == 0 && found == (k != 7) && (!found || value == k * 3));
+		}
+
+		// A change in a later transaction is seen there, but not by the older reader
+		id_t trans_id = store->begin_write_transaction(err);
+		ok = ok && err == 0 && index.insert(trans_id,keys,1) == 0 && index.flush(trans_id) == 0;
+		if (err == 0)
+			ok = (store->commit_write_transaction(trans_id) == 0 && ok);
+
+		uint64_t value = 0;
+		ok = ok && !index.find(reader,keys,value,err) && err == 0;
+		ok = ok && index.find(trans_id,keys,value,err) && value == 1;
+
+		// Threads looking up at both snapshots at once each see their own
+		Lookups lookups = { &index, reader, trans_id, keys, true };
+		OOBase::Thread* threads[4] = { NULL };
+		for (size_t i = 0; ok && i < sizeof(threads)/sizeof(threads[0]); ++i)
+		{
+			threads[i] = new (std::nothrow) OOBase::Thread(false);
+			ok = (threads[i] && threads[i]->run(&run_lookups,&lookups) == 0);
+		}
+		for (size_t i = 0; i < sizeof(threads)/sizeof(threads[0]); ++i)
+		{
+			if (threads[i])
+			{
+				threads[i]->join();
+				delete threads[i];
+			}
+		}
+		ok = ok && lookups.m_ok;
+
+		store->end_read_transaction(reader);
+		store->release();
+
+		return ok;
+	}
+
+	int flush_filter(BlockStore* store, BloomFilter& filter, const char* key)
+	{
+		int err = 0;
+		id_t trans_id = store->begin_write_transaction(err);
+		if (err != 0)
+			return err;
+
+		if (key)
+			filter.add(key,strlen(key));
+
+		if ((err = filter.flush(trans_id)) != 0)
+		{
+			store->rollback_write_transaction(trans_id);
+			filter.discard(trans_id);
+			return err;
+		}
+
+		return store->commit_write_transaction(trans_id);
+	}
+
+	bool filter_has(BlockStore* store, BloomFilter& filter, const char* key)
+	{
+		int err = 0;
+		id_t trans_id = store->begin_read_transaction(err);
+		if (err != 0)
+			return false;
+
+		bool ok = (filter.refresh(trans_id) == 0 && filter.may_contain(key,strlen(key)));
+		store->end_read_transaction(trans_id);
+		return ok;
+	}
+
+	struct Probes
+	{
+		BloomFilter*       m_filter;
+		const char* const* m_keys;
+		size_t             m_count;
+		volatile size_t    m_stop;
+		bool               m_ok;
+	};
+
+	int run_probes(void* param)
+	{
+		Probes* probes = static_cast<Probes*>(param);
+
+		bool ok = true;
+		while (ok && !OOBase::Atomic<size_t>::CompareAndSwap(probes->m_stop,0,0))
+		{
+			for (size_t i = 0; ok && i < probes->m_count; ++i)
+				ok = probes->m_filter->may_contain(probes->m_keys[i],strlen(probes->m_keys[i]));
+		}
+
+		if (!ok)
+			probes->m_ok = false;
+		return 0;
+	}
+
+	// Two filters on one root must never lose each other's keys,
+	// and a rolled back create() must leave nothing behind
+	bool test_bloom_filter()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		BloomFilter a(store);
+		id_t trans_id = store->begin_write_transaction(err);
+		bool ok = (err == 0 && a.create(trans_id,100000) == 0);
+		if (err == 0)
+		{
+			store->rollback_write_transaction(trans_id);
+			a.discard(trans_id);
+		}
+		ok = ok && a.root() == 0 && a.flush(trans_id) == EINVAL;
+
+		trans_id = store->begin_write_transaction(err);
+		ok = ok && err == 0 && a.create(trans_id,100000) == 0;
+		if (err == 0)
+			ok = (a.flush(trans_id) == 0 && store->commit_write_transaction(trans_id) == 0 && ok);
+
+		BloomFilter b(store);
+		ok = ok && b.open(a.root(),trans_id) == 0;
+
+		// Keys far apart in the filter, so each flush changes different pages
+		static const char* const keys[] = { "alpha", "beta", "gamma", "delta", "epsilon", "zeta" };
+		for (size_t i = 0; ok && i < sizeof(keys)/sizeof(keys[0]); ++i)
+			ok = (flush_filter(store,(i % 2 ? b : a),keys[i]) == 0);
+
+		BloomFilter c(store);
+		trans_id = store->begin_read_transaction(err);
+		ok = ok && err == 0 && c.open(a.root(),trans_id) == 0;
+		if (err == 0)
+			store->end_read_transaction(trans_id);
+
+		for (size_t i = 0; ok && i < sizeof(keys)/sizeof(keys[0]); ++i)
+			ok = filter_has(store,a,keys[i]) && filter_has(store,b,keys[i]) && filter_has(store,c,keys[i]);
+
+		// Probe c from other threads while it reloads itself
+		Probes probes = { &c, keys, sizeof(keys)/sizeof(keys[0]), 0, true };
+		OOBase::Thread* threads[2] = { NULL, NULL };
+		for (size_t i = 0; ok && i < sizeof(threads)/sizeof(threads[0]); ++i)
+		{
+			threads[i] = new (std::nothrow) OOBase::Thread(false);
+			ok = (threads[i] && threads[i]->run(&run_probes,&probes) == 0);
+		}
+
+		static const char* const more[] = { "eta", "theta", "iota", "kappa", "lambda", "mu", "nu", "xi" };
+		for (size_t i = 0; ok && i < sizeof(more)/sizeof(more[0]); ++i)
+			ok = (flush_filter(store,a,more[i]) == 0 && filter_has(store,c,more[i]));
+
+		OOBase::Atomic<size_t>::Exchange(probes.m_stop,1);
+		for (size_t i = 0; i < sizeof(threads)/sizeof(threads[0]); ++i)
+		{
+			if (threads[i])
+			{
+				threads[i]->join();
+				delete threads[i];
+			}
+		}
+		ok = ok && probes.m_ok;
+
+		store->release();
+		return ok;
+	}
+
+	// Collects the results of AsyncBlockStore callbacks, in the order they arrive
+	struct Results
+	{
+		OOBase::Condition::Mutex m_lock;
+		OOBase::Condition        m_condition;
+		size_t                   m_count;
+		id_t                     m_ids[8];
+		int                      m_errs[8];
+
+		void add(const id_t& id, int err)
+		{
+			OOBase::Guard<OOBase::Condition::Mutex> guard(m_lock);
+			if (m_count < 8)
+			{
+				m_ids[m_count] = id;
+				m_errs[m_count] = err;
+			}
+			++m_count;
+			m_condition.signal();
+		}
+
+		bool wait_for(size_t count)
+		{
+			OOBase::Guard<OOBase::Condition::Mutex> guard(m_lock);
+			OOBase::Timeout timeout(10,0);
+			while (m_count < count)
+			{
+				if (!m_condition.wait(m_lock,timeout))
+					return false;
+			}
+			return true;
+		}
+	};
+
+	void on_trans(void* param, const id_t& trans_id, int err)
+	{
+		static_cast<Results*>(param)->add(trans_id,err);
+	}
+
+	void on_block(void* param, const id_t& block_id, BlockStore::Block, int err)
+	{
+		static_cast<Results*>(param)->add(block_id,err);
+	}
+
+	// A second begin, or a checkpoint, queued before the first transaction commits
+	// must not stall the writer thread
+	bool test_async_begins()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		id_t block_id = 0;
+		bool ok = (write_value(store,block_id,1) == 0);
+
+		AsyncBlockStore async;
+		Results first;
+		Results second;
+		Results writes;
+		Results checkpoints;
+		first.m_count = second.m_count = writes.m_count = checkpoints.m_count = 0;
+
+		ok = ok && async.open(store) == 0;
+		ok = ok && async.begin_write_transaction(&on_trans,&first) == 0 && async.begin_write_transaction(&on_trans,&second) == 0;
+		ok = ok && first.wait_for(1) && first.m_errs[0] == 0;
+
+		id_t trans_id = (ok ? first.m_ids[0] : 0);
+		ok = ok && async.checkpoint(&on_trans,&checkpoints) == 0;
+		ok = ok && async.update_block(block_id,trans_id,new_block(store->block_size(),2),&on_block,&writes) == 0;
+		ok = ok && async.commit_write_transaction(trans_id,&on_trans,&writes) == 0;
+		ok = ok && writes.wait_for(2) && writes.m_errs[0] == 0 && writes.m_errs[1] == 0;
+
+		ok = ok && second.wait_for(1) && second.m_errs[0] == 0 && second.m_ids[0] == trans_id + 1;
+		ok = ok && checkpoints.m_count == 0;
+		ok = ok && async.rollback_write_transaction(second.m_ids[0],&on_trans,&writes) == 0 && writes.wait_for(3);
+		ok = ok && checkpoints.wait_for(1) && checkpoints.m_errs[0] == 0;
+
+		async.close();
+
+		ok = ok && has_value(store,block_id,2);
+		store->release();
+
+		return ok;
+	}
+
+	// Patch one byte of block_id in a new WriteIntents transaction
+	WriteIntents::Transaction* patch_byte(WriteIntents& intents, const id_t& block_id, size_t offset, unsigned char value)
+	{
+		int err = 0;
+		WriteIntents::Transaction* trans = intents.begin(err);
+		if (trans && intents.patch(trans,block_id,offset,&value,1) != 0)
+		{
+			intents.abort(trans);
+			trans = NULL;
+		}
+		return trans;
+	}
+
+	bool has_byte(BlockStore* store, const id_t& block_id, size_t offset, unsigned char value)
+	{
+		int err = 0;
+		id_t trans_id = store->begin_read_transaction(err);
+		if (err != 0)
+			return false;
+
+		BlockStore::Block block = store->get_block(block_id,trans_id,err);
+		bool ok = (err == 0 && static_cast<const unsigned char*>(static_cast<const void*>(block))[offset] == value);
+
+		store->end_read_transaction(trans_id);
+		return ok;
+	}
+
+	// Transactions from the same snapshot merge their changes to different bytes of a block,
+	// and fail on the same bytes or key ranges, whoever committed first
+	bool test_write_intents()
+	{
+		remove_store(s_path);
+
+		int err = 0;
+		BlockStore* store = BlockStore::open(s_path,false,err);
+		if (!store)
+			return false;
+
+		id_t block_id = 0;
+		bool ok = (write_value(store,block_id,0) == 0);
+		{
+			WriteIntents intents(store);
+
+			// Different bytes merge
+			WriteIntents::Transaction* t1 = patch_byte(intents,block_id,0,1);
+			WriteIntents::Transaction* t2 = patch_byte(intents,block_id,1,2);
+			ok = ok && t1 && t2;
+			ok = (t1 && intents.commit(t1) == 0 && ok);
+			ok = (t2 && intents.commit(t2) == 0 && ok);
+			ok = ok && has_byte(store,block_id,0,1) && has_byte(store,block_id,1,2);
+
+			// The same bytes conflict
+			t1 = patch_byte(intents,block_id,2,3);
+			t2 = patch_byte(intents,block_id,2,4);
+			ok = ok && t1 && t2;
+			ok = (t1 && intents.commit(t1) == 0 && ok);
+			ok = (t2 && intents.commit(t2) == EAGAIN && ok);
+			ok = ok && has_byte(store,block_id,2,3);
+
+			// Overlapping key ranges can't both be held, and conflict once committed
+			t1 = patch_byte(intents,block_id,3,5);
+			t2 = patch_byte(intents,block_id,4,6);
+			ok = ok && t1 && t2;
+			ok = ok && intents.lock_range(t1,10,20) == 0 && intents.lock_range(t2,15,25) == EBUSY;
+			ok = (t1 && intents.commit(t1) == 0 && ok);
+			ok = ok && intents.lock_range(t2,15,25) == 0;
+			ok = (t2 && intents.commit(t2) == EAGAIN && ok);
+			ok = ok && has_byte(store,block_id,3,5) && has_byte(store,block_id,4,0);
+
+			// Commits made straight to the store are caught where they change our bytes
+			t1 = patch_byte(intents,block_id,5,7);
+			ok = ok && t1 && write_value(store,block_id,0x55) == 0;
+			ok = (t1 && intents.commit(t1) == EAGAIN && ok);
+			ok = ok && has_byte(store,block_id,5,0x55);
+
+			// A failed commit leaves nothing behind to conflict with later ones
+			t1 = patch_byte(intents,block_id,5,8);
+			ok = (t1 && intents.commit(t1) == 0 && ok);
+			ok = ok && has_byte(store,block_id,5,8) && has_byte(store,block_id,6,0x55);
+		}
+
+		// The intents keep the store open after we let go of it
+		WriteIntents* intents = new (std::nothrow) WriteIntents(store);
+		store->release();
+		if (!intents)
+			return false;
+
+		WriteIntents::Transaction* t = patch_byte(*intents,block_id,7,9);
+		ok = (t && intents->commit(t) == 0 && ok);
+		delete intents;
+
+		return ok;
+	}
+
+	struct Test
+	{
+		const char* m_name;
+		bool (*m_fn)();
+	};
+
+	const Test s_tests[] =
+	{
+		{ "varint", &test_varint },
+		{ "reopen", &test_reopen },
+		{ "recover", &test_recover },
+		{ "checkpoint_reader", &test_checkpoint_reader },
+		{ "dead_reader", &test_dead_reader },
+		{ "alloc_block", &test_alloc_block },
+		{ "backup_restore", &test_backup_restore },
+		{ "compact_in_transaction", &test_compact_in_transaction },
+		{ "replica_restart", &test_replica_restart },
+		{ "hash_index", &test_hash_index },
+		{ "bloom_filter", &test_bloom_filter },
+		{ "async_begins", &test_async_begins },
+		{ "write_intents", &test_write_intents }
+	};
+}
+
+int main(int argc, char* argv[])
+{
+	size_t failed = 0;
+	for (size_t i = 0; i < sizeof(s_tests)/sizeof(s_tests[0]); ++i)
+	{
+		bool ok = (*s_tests[i].m_fn)();
+		printf("%s: %s\n",ok ? "PASS" : "FAIL",s_tests[i].m_name);
+		if (!ok)
+			++failed;
+	}
+
+	remove_store(s_path);
+	remove_store(s_copy_path);
+	unlink(s_incremental_path);
+
+	return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}